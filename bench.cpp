@@ -0,0 +1,810 @@
+#include "editor.hpp"
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#ifdef SPRITE_PAINT_BENCH_EXPORT
+#include "includes/raylib.h"
+#endif
+
+// Benchmarks of the drawing hot paths at several canvas sizes.
+// Progress goes to stderr, the results are printed to stdout as one JSON document.
+// Usage: sprite_paint_bench [max canvas size]
+
+typedef std::chrono::steady_clock Clock;
+
+const u32 WALL = 0xFFFFFFFF;
+const u32 COLOR_A = 0xFF000000;
+const u32 COLOR_B = 0xFF0000FF;
+// Minimum time spent repeating each measurement
+const double MIN_SECONDS = 0.25;
+
+struct Bench_Size {
+    int width;
+    int height;
+};
+
+// 500x1000 is the canvas the app creates by default
+const Bench_Size SIZES[] = {{64, 64}, {256, 256}, {500, 1000}, {1024, 1024}, {4096, 4096}, {8192, 8192}};
+
+struct Result {
+    std::string name;
+    Bench_Size size;
+    double value;
+    const char* unit;
+};
+
+std::vector<Result> results;
+
+// Results are added here so the compiler can't drop the work being timed
+volatile u64 sink = 0;
+
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void report(const char* name, Bench_Size size, double value, const char* unit) {
+    results.push_back({name, size, value, unit});
+    fprintf(stderr, "%-40s %5dx%-5d %14.2f %s\n", name, size.width, size.height, value, unit);
+}
+
+// Calls run(i) until MIN_SECONDS passed and at least min_runs times, returns seconds per call
+template<typename F>
+double time_runs(F run, int min_runs = 1) {
+    int runs = 0;
+    Clock::time_point start = Clock::now();
+    for (; runs < min_runs || seconds_since(start) < MIN_SECONDS; runs++) run(runs);
+    return seconds_since(start) / runs;
+}
+
+// Rows of wall with the gap alternating between the left and right end, the fill snakes through every row
+void make_maze(Canvas& canvas) {
+    for (int y = 1; y < canvas.height; y += 2) {
+	if ((y / 2) % 2 == 0) canvas.fill_span(y, 0, canvas.width - 1, WALL);
+	else canvas.fill_span(y, 1, canvas.width, WALL);
+    }
+}
+
+// One pixel wide vertical corridors joined at the top, every span of the fill is a single pixel
+void make_comb(Canvas& canvas) {
+    for (int y = 1; y < canvas.height; y++) {
+	for (int x = 1; x < canvas.width; x += 2) canvas.set(x, y, WALL);
+    }
+}
+
+// Upload size of the tiles dirtied since the last call, the same tiles Sprite_Window::flush sends
+u64 take_dirty_bytes(Canvas& canvas) {
+    u64 bytes = 0;
+    for (int i = 0; i < canvas.tile_count(); i++) {
+	if (canvas.dirty[i]) bytes += TILE_PIXELS * sizeof(u32);
+	canvas.dirty[i] = 0;
+    }
+    return bytes;
+}
+
+void bench_set_pixel(Bench_Size size) {
+    Editor editor;
+    editor.init(size.width, size.height, COLOR_A);
+    const int count = 1 << 16;
+    std::vector<int> xs(count);
+    std::vector<int> ys(count);
+    srand(1);
+    for (int i = 0; i < count; i++) {
+	xs[i] = rand() % size.width;
+	ys[i] = rand() % size.height;
+    }
+    double seconds = time_runs([&](int run) {
+	for (int i = 0; i < count; i++) editor.canvas().set(xs[i], ys[i], run % 2 ? COLOR_A : COLOR_B);
+    });
+    report("set_pixel", size, count / seconds / 1e6, "Mpx/s");
+    // One click in DRAW mode, including the undo step
+    int i = 0;
+    seconds = time_runs([&](int run) {
+	for (int j = 0; j < 256; j++, i = (i + 1) % count) editor.set_pixel(xs[i], ys[i], run % 2 ? COLOR_A : COLOR_B);
+    });
+    report("set_pixel_undoable", size, 256 / seconds / 1e6, "Mops/s");
+}
+
+// A fast freehand stroke: every frame the mouse jumped a quarter of the canvas along a circle.
+// Each frame joins the new sample, writes the batch and recomposites, as Sprite_Window::flush does.
+void bench_stroke(Bench_Size size) {
+    Editor editor;
+    editor.init(size.width, size.height, COLOR_A);
+    int center_x = size.width / 2;
+    int center_y = size.height / 2;
+    float radius = std::min(size.width, size.height) / 2 - 1;
+    u64 stamps = 0;
+    int frames = 0;
+    editor.begin_stroke(center_x, center_y, COLOR_B);
+    double seconds = time_runs([&](int frame) {
+	float angle = frame * 0.5f;
+	editor.stroke_to(center_x + (int)(cosf(angle) * radius), center_y + (int)(sinf(angle) * radius));
+	frames++;
+	stamps += editor.stroke_points.size();
+	editor.update_composite();
+	sink += take_dirty_bytes(editor.composite);
+    }, 10);
+    editor.end_stroke();
+    report("stroke_frame", size, seconds * 1e6, "us/frame");
+    report("stroke_stamps", size, stamps / (seconds * frames) / 1e6, "Mstamps/s");
+}
+
+// bench_stroke's circling stroke with an 8 pixel brush under each symmetry. The copies are
+// stamped in the same flush, upload is the tiles all of them dirtied per frame.
+void bench_symmetry(Bench_Size size) {
+    for (int symmetry = 0; symmetry < SYMMETRY_MAX; symmetry++) {
+	Editor editor;
+	editor.init(size.width, size.height, COLOR_A);
+	editor.mirror.symmetry = (Symmetry)symmetry;
+	editor.brush.set_size(8);
+	int center_x = size.width / 2;
+	int center_y = size.height / 2;
+	float radius = std::min(size.width, size.height) / 3;
+	u64 bytes = 0;
+	int frames = 0;
+	editor.begin_stroke(center_x + (int)radius, center_y, COLOR_B);
+	double seconds = time_runs([&](int frame) {
+	    float angle = frame * 0.05f;
+	    editor.stroke_to(center_x + (int)(cosf(angle) * radius), center_y + (int)(sinf(angle) * radius));
+	    editor.update_composite();
+	    bytes += take_dirty_bytes(editor.composite);
+	    frames++;
+	}, 10);
+	editor.end_stroke();
+	std::string name = std::string("symmetry_") + symmetry_as_string((Symmetry)symmetry);
+	report((name + "_frame").c_str(), size, seconds * 1e6, "us/frame");
+	report((name + "_upload").c_str(), size, (double)bytes / frames, "bytes/frame");
+    }
+}
+
+// Soft round stamps at random positions, for every brush mode at each SIMD level
+void bench_brush(Bench_Size size) {
+    Canvas canvas;
+    canvas.init(size.width, size.height, COLOR_B);
+    Brush brush;
+    brush.set_shape(BRUSH_ROUND);
+    brush.set_hardness(0.5f);
+    srand(4);
+    for (int brush_size : {16, 64, 256}) {
+	brush.set_size(brush_size);
+	u64 area = 0;
+	for (const Span& row : brush.rows) area += row.x1 - row.x0;
+	for (int mode = 0; mode < BRUSH_MODE_MAX; mode++) {
+	    brush.mode = (Brush_Mode)mode;
+	    for (int level = SIMD_SCALAR; level <= simd_supported(); level++) {
+		set_simd_level((Simd_Level)level);
+		double seconds = time_runs([&](int run) {
+		    // Half transparent so blend does the full computation
+		    brush.stamp(canvas, rand() % size.width, rand() % size.height, run % 2 ? 0x80FF8040 : 0x804080FF);
+		}, 10);
+		std::string name = std::string("brush_") + brush_mode_as_string((Brush_Mode)mode) + "_" +
+		    std::to_string(brush_size) + "_" + simd_level_as_string((Simd_Level)level);
+		report(name.c_str(), size, area / seconds / 1e6, "Mpx/s");
+	    }
+	}
+    }
+    set_simd_level(simd_supported());
+}
+
+void bench_fill(const char* name, Bench_Size size, void (*make)(Canvas&)) {
+    Canvas canvas;
+    canvas.init(size.width, size.height, COLOR_A);
+    if (make) make(canvas);
+    Flood_Fill flood_fill;
+    flood_fill.parallel = false;
+    u64 filled = 0;
+    // Alternate colors so every run refills the same region
+    double seconds = time_runs([&](int run) {
+	filled = flood_fill.fill(canvas, 0, 0, run % 2 ? COLOR_A : COLOR_B);
+    }, 2);
+    report(name, size, filled / seconds / 1e6, "Mpx/s");
+}
+
+// fill_parallel() with 1, 2, 4... threads up to one per core, on the canvases of bench_fill.
+// fill_empty, fill_maze and fill_comb are the serial fill of the same regions. Each thread
+// count first fills a copy of the canvas both ways, with and without tolerance, and the
+// pixels and counts have to match.
+void bench_fill_parallel(const char* name, Bench_Size size, void (*make)(Canvas&)) {
+    Canvas canvas;
+    canvas.init(size.width, size.height, COLOR_A);
+    if (make) make(canvas);
+    Flood_Fill flood_fill;
+    int pool_size = job_pool().size();
+    std::vector<int> thread_counts;
+    for (int threads = 1; threads < pool_size; threads *= 2) thread_counts.push_back(threads);
+    thread_counts.push_back(pool_size);
+    for (int threads : thread_counts) {
+	job_pool().init(threads - 1);
+	for (int tolerance : {0, 64}) {
+	    Canvas serial = canvas;
+	    Canvas parallel = canvas;
+	    Flood_Fill serial_fill;
+	    serial_fill.parallel = false;
+	    serial_fill.tolerance = tolerance;
+	    Flood_Fill parallel_fill;
+	    parallel_fill.tolerance = tolerance;
+	    u64 serial_count = serial_fill.fill(serial, 0, 0, COLOR_B);
+	    u64 parallel_count = parallel_fill.fill_parallel(parallel, 0, 0, COLOR_B, job_pool());
+	    if (serial_count != parallel_count || serial.pixels != parallel.pixels) {
+		fprintf(stderr, "fill_parallel %s with %d threads and tolerance %d differs from the serial fill\n", name, threads, tolerance);
+	    }
+	}
+	u64 filled = 0;
+	double seconds = time_runs([&](int run) {
+	    filled = flood_fill.fill_parallel(canvas, 0, 0, run % 2 ? COLOR_A : COLOR_B, job_pool());
+	}, 2);
+	report(("fill_parallel_" + std::string(name) + "_" + std::to_string(threads) + "_threads").c_str(), size,
+	       filled / seconds / 1e6, "Mpx/s");
+    }
+    job_pool().init(pool_size - 1);
+}
+
+// Tolerant fills over a noisy gradient, like an imported photo, at each SIMD level. The tolerance
+// covers the whole canvas. The canvas is restored between runs, outside the timing.
+void bench_fill_tolerance(Bench_Size size) {
+    Canvas canvas;
+    canvas.init(size.width, size.height, COLOR_A);
+    srand(5);
+    for (int y = 0; y < size.height; y++) {
+	for (int x = 0; x < size.width; x++) {
+	    u32 gray = 96 + x * 32 / size.width + rand() % 16;
+	    canvas.set(x, y, 0xFF000000 | gray << 16 | gray << 8 | gray);
+	}
+    }
+    std::vector<u32> original = canvas.pixels;
+    Flood_Fill flood_fill;
+    for (int metric = 0; metric < METRIC_MAX; metric++) {
+	flood_fill.metric = (Color_Metric)metric;
+	// Gray differences of up to 47, the euclidean distance of those is sqrt(3) times longer
+	flood_fill.tolerance = metric == METRIC_CHANNEL ? 48 : 84;
+	for (int level = SIMD_SCALAR; level <= simd_supported(); level++) {
+	    set_simd_level((Simd_Level)level);
+	    double seconds = 0;
+	    u64 filled = 0;
+	    for (int run = 0; run < 2 || seconds < MIN_SECONDS; run++) {
+		canvas.pixels = original;
+		Clock::time_point start = Clock::now();
+		filled += flood_fill.fill(canvas, 0, 0, COLOR_B);
+		seconds += seconds_since(start);
+	    }
+	    std::string name = std::string("fill_tolerance_") + color_metric_as_string((Color_Metric)metric) + "_" +
+		simd_level_as_string((Simd_Level)level);
+	    report(name.c_str(), size, filled / seconds / 1e6, "Mpx/s");
+	}
+    }
+    set_simd_level(simd_supported());
+}
+
+// Region labels of a canvas: the build, then an undoable fill of the region at (0, 0) through the
+// editor, once found by the flood fill and once taken from fresh labels. The labels are rebuilt
+// before each labelled fill, outside the timing, as the app does in the background.
+void bench_labels(const char* name, Bench_Size size, void (*make)(Canvas&)) {
+    Editor editor;
+    editor.init(size.width, size.height, COLOR_A);
+    if (make) make(editor.canvas());
+    Region_Labels labels;
+    double seconds = time_runs([&](int) {
+	labels.build(editor.canvas());
+    });
+    report((std::string("labels_build_") + name).c_str(), size, seconds * 1e3, "ms");
+    Label_Cache& cache = editor.labels;
+    // Hovering over a region that is still valid, what the fill preview does when labels arrived
+    cache.labels = labels;
+    cache.layer = editor.active;
+    cache.checkpoint = editor.canvas().checkpoint();
+    cache.ready = true;
+    seconds = time_runs([&](int run) {
+	sink += cache.lookup(editor.canvas(), editor.active, run % size.width, 0) != nullptr;
+    }, 2);
+    report((std::string("labels_lookup_") + name).c_str(), size, seconds * 1e6, "us");
+    const Region* region = cache.lookup(editor.canvas(), editor.active, 0, 0);
+    u64 pixels = region ? region->pixels : 0;
+    for (int cached = 0; cached < 2; cached++) {
+	double seconds = 0;
+	int runs = 0;
+	for (; runs < 2 || seconds < MIN_SECONDS; runs++) {
+	    cache.ready = false;
+	    if (cached) {
+		cache.labels.build(editor.canvas());
+		cache.checkpoint = editor.canvas().checkpoint();
+		cache.ready = true;
+	    }
+	    // Alternate colors so every run refills the same region
+	    Clock::time_point start = Clock::now();
+	    editor.fill(0, 0, runs % 2 ? COLOR_A : COLOR_B);
+	    seconds += seconds_since(start);
+	}
+	report((std::string(cached ? "fill_labels_" : "fill_flood_") + name).c_str(), size,
+	       (double)pixels * runs / seconds / 1e6, "Mpx/s");
+    }
+    // Starting a rebuild after a one pixel edit, as the fill mode does each frame after an
+    // edit. Only the edited tile is copied into the snapshot, the build is dropped untimed.
+    cache.start(editor.canvas(), editor.active);
+    cache.wait();
+    double start_seconds = 0;
+    int starts = 0;
+    for (; starts < 2 || start_seconds < MIN_SECONDS; starts++) {
+	editor.set_pixel(starts % size.width, 0, starts % 2 ? COLOR_A : COLOR_B);
+	Clock::time_point start = Clock::now();
+	cache.start(editor.canvas(), editor.active);
+	start_seconds += seconds_since(start);
+	cache.wait();
+    }
+    report((std::string("labels_start_after_edit_") + name).c_str(), size, start_seconds / starts * 1e6, "us");
+}
+
+// Replacing one color of a 16 color palette everywhere, once on the calling thread only and
+// once with the whole job pool. undo_bytes is what the compact entry takes, pixel_delta_bytes
+// what the same change takes as a regular before/after delta.
+void bench_replace(Bench_Size size) {
+    Editor editor;
+    editor.init(size.width, size.height, COLOR_A);
+    u32 palette[16];
+    srand(6);
+    for (u32& color : palette) color = 0xFF000000 | ((u32)rand() << 8 ^ (u32)rand());
+    // 4x4 blocks, closer to pixel art than single pixels
+    for (int y = 0; y < size.height; y++) {
+	for (int x = 0; x < size.width; x++) {
+	    u32 hash = (u32)(x / 4) * 2654435761u ^ (u32)(y / 4) * 2246822519u;
+	    editor.canvas().set(x, y, palette[(hash >> 16) % 16]);
+	}
+    }
+    int pool_size = job_pool().size();
+    std::vector<int> thread_counts = {1};
+    if (pool_size > 1) thread_counts.push_back(pool_size);
+    u64 replaced = 0;
+    for (int threads : thread_counts) {
+	job_pool().init(threads - 1);
+	double seconds = time_runs([&](int run) {
+	    replaced = run % 2 ? editor.replace_color(COLOR_B, palette[0]) : editor.replace_color(palette[0], COLOR_B);
+	}, 2);
+	report(("replace_color_" + std::to_string(threads) + "_threads").c_str(), size,
+	       (double)size.width * size.height / seconds / 1e6, "Mpx/s");
+    }
+    const Stored_Entry& entry = editor.history.entries.back();
+    report("replace_color_undo_bytes", size, entry.raw_bytes, "bytes");
+    report("replace_color_undo_compressed_bytes", size, entry.size, "bytes");
+    report("replace_color_pixel_delta_bytes", size, sizeof(Undo_Entry) + entry.run_count * sizeof(Delta_Run) +
+	   (double)replaced * 2 * sizeof(u32), "bytes");
+    double seconds = time_runs([&](int run) {
+	if (run % 2) editor.redo();
+	else editor.undo();
+    }, 2);
+    report("replace_color_undo", size, seconds * 1e3, "ms");
+}
+
+// Typical edits on a sprite whose left half is 4x4 blocks of a 16 color palette and right half
+// is empty: a fill of the empty half, a brush stroke across both and a filled ellipse. For each
+// the size of the pixel delta, what the history ring keeps of it, and the time an undo takes
+// to decompress and write it back.
+void bench_history(Bench_Size size) {
+    Editor editor;
+    editor.init(size.width, size.height, COLOR_A);
+    u32 palette[16];
+    srand(8);
+    for (u32& color : palette) color = 0xFF000000 | ((u32)rand() << 8 ^ (u32)rand());
+    for (int y = 0; y < size.height; y++) {
+	for (int x = 0; x < size.width / 2; x++) {
+	    u32 hash = (u32)(x / 4) * 2654435761u ^ (u32)(y / 4) * 2246822519u;
+	    editor.canvas().set(x, y, palette[(hash >> 16) % 16]);
+	}
+    }
+    const char* names[] = {"fill", "stroke", "ellipse"};
+    for (int edit = 0; edit < 3; edit++) {
+	if (edit == 0) editor.fill(size.width - 1, 0, COLOR_B);
+	else if (edit == 1) {
+	    editor.brush.set_size(16);
+	    editor.begin_stroke(0, size.height / 2, COLOR_B);
+	    for (int x = 0; x < size.width; x += 8) editor.stroke_to(x, size.height / 2 + (int)(sinf(x * 0.02f) * size.height / 4));
+	    editor.end_stroke();
+	}
+	else {
+	    std::vector<Span> spans;
+	    rasterize_ellipse(size.width / 4, size.height / 4, size.width * 3 / 4, size.height * 3 / 4, true, spans);
+	    editor.draw_spans(spans, COLOR_B);
+	}
+	const Stored_Entry& entry = editor.history.entries.back();
+	std::string name = std::string("history_") + names[edit];
+	report((name + "_delta_bytes").c_str(), size, entry.raw_bytes, "bytes");
+	report((name + "_compressed_bytes").c_str(), size, entry.size + entry.spill.size(), "bytes");
+	double seconds = time_runs([&](int run) {
+	    if (run % 2) editor.redo();
+	    else editor.undo();
+	}, 2);
+	report((name + "_undo").c_str(), size, seconds * 1e3, "ms");
+	editor.redo();
+    }
+}
+
+// Alternative versions of the sprite from bench_history: after a fill, 32 branches of 3 brush
+// strokes each in a different place. Reports what the history keeps for all of them next to a
+// copy of the sprite, and the time to switch from the tip of one branch to another.
+void bench_branches(Bench_Size size) {
+    const int BRANCHES = 32;
+    const int STROKES = 3;
+    Editor editor;
+    editor.init(size.width, size.height, COLOR_A);
+    editor.fill(0, 0, COLOR_B);
+    u64 base = editor.history.used();
+    editor.brush.set_size(8);
+    for (int branch = 0; branch < BRANCHES; branch++) {
+	for (int i = 0; branch > 0 && i < STROKES; i++) editor.undo();
+	for (int stroke = 0; stroke < STROKES; stroke++) {
+	    int y = (branch * STROKES + stroke) * size.height / (BRANCHES * STROKES);
+	    editor.begin_stroke(0, y, 0xFF000000 | (u32)branch * 0x070B0D);
+	    for (int x = 0; x < size.width; x += 8) editor.stroke_to(x, y + (int)(sinf(x * 0.05f + branch) * 8));
+	    editor.end_stroke();
+	}
+    }
+    report("branches_history_bytes", size, editor.history.used() - base, "bytes");
+    report("branches_sprite_copy_bytes", size, (double)size.width * size.height * sizeof(u32) * BRANCHES, "bytes");
+    double seconds = time_runs([&](int) {
+	for (int i = 0; i < STROKES; i++) editor.undo();
+	editor.select_branch(1);
+	for (int i = 0; i < STROKES; i++) editor.redo();
+    }, 8);
+    report("branches_switch", size, seconds * 1e3, "ms");
+}
+
+// A session of small edits the way pixel art is drawn: single pixels, short lines, small
+// strokes and boxes, with undos and redos among them. The session is journaled one frame of
+// 16 edits at a time, then the journal is read back, planned and replayed onto a new editor.
+void bench_journal(Bench_Size size) {
+    const char* path = "sprite_paint_bench.journal";
+    const int EDITS = 1 << 18;
+    const int EDITS_PER_FRAME = 16;
+    Editor editor;
+    editor.init(size.width, size.height, COLOR_A);
+    editor.journal.open(path, 0);
+    editor.journal.add(JOURNAL_INIT, Journal_Init{size.width, size.height, COLOR_A});
+    srand(9);
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < EDITS; i++) {
+	int x = rand() % size.width;
+	int y = rand() % size.height;
+	u32 color = 0xFF000000 | rand();
+	int kind = rand() % 20;
+	if (kind < 8) editor.set_pixel(x, y, color);
+	else if (kind < 13) editor.draw_line(x, y, x + rand() % 32 - 16, y + rand() % 32 - 16, color);
+	else if (kind < 15) {
+	    editor.begin_stroke(x, y, color);
+	    for (int j = 1; j <= 8; j++) editor.stroke_to(x + j * 2, y + j);
+	    editor.end_stroke();
+	}
+	else if (kind < 16) {
+	    std::vector<Span> spans;
+	    rasterize_rect(x, y, x + 15, y + 15, true, spans);
+	    editor.draw_spans(spans, color);
+	}
+	else if (kind < 19) editor.undo();
+	else editor.redo();
+	if (i % EDITS_PER_FRAME == 0) editor.journal.flush();
+    }
+    double session_seconds = seconds_since(start);
+    editor.journal.close();
+    std::vector<u8> records;
+    u64 valid_bytes = 0;
+    start = Clock::now();
+    read_journal(path, records, valid_bytes);
+    report("journal_read", size, seconds_since(start) * 1e3, "ms");
+    report("journal_bytes_per_edit", size, (double)valid_bytes / EDITS, "bytes");
+    Journal_Plan plan;
+    start = Clock::now();
+    plan_replay(records, plan);
+    report("journal_plan", size, seconds_since(start) * 1e3, "ms");
+    Editor recovered;
+    start = Clock::now();
+    recovered.replay(records, plan, nullptr);
+    double replay_seconds = seconds_since(start);
+    report("journal_replay", size, replay_seconds * 1e3, "ms");
+    report("journal_replay_rate", size, EDITS / replay_seconds / 1e6, "Medits/s");
+    report("journal_session_rate", size, EDITS / session_seconds / 1e6, "Medits/s");
+    remove(path);
+    bool same = recovered.canvas().pixels == editor.canvas().pixels;
+    if (!same) fprintf(stderr, "journal replay differs from the session\n");
+    // As far back as the recovered history goes, undo has to reach the same images
+    while (recovered.undo()) {
+	if (!editor.undo()) break;
+    }
+    if (recovered.canvas().pixels != editor.canvas().pixels) fprintf(stderr, "undo after a journal replay differs from the session\n");
+    // An edit undone and redone long ago is kept for replay, the newer edits that aren't
+    // mustn't leave undo a way back to it
+    Editor deep;
+    deep.init(size.width, size.height, COLOR_A);
+    deep.journal.open(path, 0);
+    deep.journal.add(JOURNAL_INIT, Journal_Init{size.width, size.height, COLOR_A});
+    deep.set_pixel(0, 0, COLOR_B);
+    deep.undo();
+    deep.redo();
+    for (int i = 0; i < JOURNAL_UNDO_DEPTH + 44; i++) deep.set_pixel(i % size.width, 1 + i / size.width % (size.height - 1), COLOR_B);
+    deep.journal.close();
+    read_journal(path, records, valid_bytes);
+    Journal_Plan deep_plan;
+    plan_replay(records, deep_plan);
+    Editor deep_recovered;
+    deep_recovered.replay(records, deep_plan, nullptr);
+    remove(path);
+    while (deep_recovered.undo()) deep.undo();
+    if (deep_recovered.canvas().pixels != deep.canvas().pixels) fprintf(stderr, "deep undo after a journal replay differs from the session\n");
+    // A recovery from a save that has to pick the same branch: after the save B is painted,
+    // undone for C, and C is undone to take B again
+    Editor branching;
+    branching.init(size.width, size.height, COLOR_A);
+    branching.journal.open(path, 0);
+    branching.journal.add(JOURNAL_INIT, Journal_Init{size.width, size.height, COLOR_A});
+    branching.set_pixel(0, 0, COLOR_B);
+    std::vector<u32> saved(size.width * size.height);
+    branching.canvas().copy_to_linear(saved.data());
+    bool opaque = false;
+    u64 hash = journal_hash(saved.data(), saved.size(), opaque);
+    branching.journal_save(path);
+    branching.journal_saved(hash, opaque);
+    branching.set_pixel(1, 0, 0xFF00FF00);
+    branching.undo();
+    branching.set_pixel(1, 0, COLOR_B);
+    branching.undo();
+    branching.select_branch(-1);
+    branching.redo();
+    branching.journal.close();
+    read_journal(path, records, valid_bytes);
+    Journal_Plan branch_plan;
+    plan_replay(records, branch_plan);
+    Editor branch_recovered;
+    branch_recovered.replay(records, branch_plan, branch_plan.from_save ? saved.data() : nullptr);
+    remove(path);
+    if (!branch_plan.from_save || branch_recovered.canvas().pixels != branching.canvas().pixels) {
+	fprintf(stderr, "journal replay from a save takes another branch than the session\n");
+    }
+}
+
+// Rubber-banding each shape from the canvas corner to a point moving along the diagonal, once
+// per frame: rasterizing the preview spans, then writing the shape into the canvas.
+void bench_shapes(Bench_Size size) {
+    Canvas canvas;
+    canvas.init(size.width, size.height, COLOR_A);
+    std::vector<Span> spans;
+    const char* names[] = {"rect", "filled_rect", "ellipse", "filled_ellipse"};
+    for (int shape = 0; shape < 4; shape++) {
+	bool filled = shape % 2;
+	auto rasterize = [&](int frame) {
+	    // Between a quarter of the canvas and all of it
+	    int step = frame % 64;
+	    int x1 = size.width / 4 + (size.width - 1 - size.width / 4) * step / 63;
+	    int y1 = size.height / 4 + (size.height - 1 - size.height / 4) * step / 63;
+	    spans.clear();
+	    if (shape < 2) rasterize_rect(0, 0, x1, y1, filled, spans);
+	    else rasterize_ellipse(0, 0, x1, y1, filled, spans);
+	};
+	double seconds = time_runs([&](int frame) {
+	    rasterize(frame);
+	    sink += spans.size();
+	}, 10);
+	report((std::string("shape_preview_") + names[shape]).c_str(), size, seconds * 1e6, "us/frame");
+	u64 pixels = 0;
+	int frames = 0;
+	seconds = time_runs([&](int frame) {
+	    rasterize(frame);
+	    canvas.fill_spans(spans, frame % 2 ? COLOR_A : COLOR_B);
+	    for (const Span& span : spans) pixels += span.x1 - span.x0;
+	    frames++;
+	}, 10);
+	report((std::string("shape_draw_") + names[shape]).c_str(), size, (double)pixels / frames / seconds / 1e6, "Mpx/s");
+    }
+}
+
+// Lines between random points in a box a quarter larger than the canvas on each side, so some
+// are clipped, rasterized and written at several widths and anti-aliased
+void bench_lines(Bench_Size size) {
+    Canvas canvas;
+    canvas.init(size.width, size.height, COLOR_A);
+    std::vector<Point> ends(1024);
+    srand(7);
+    for (Point& end : ends) end = {rand() % (size.width * 3 / 2) - size.width / 4, rand() % (size.height * 3 / 2) - size.height / 4};
+    std::vector<Span> spans;
+    std::vector<u8> coverage;
+    for (int width : {1, 4, 16, MAX_LINE_WIDTH, 0}) {
+	double seconds = time_runs([&](int run) {
+	    const Point& a = ends[run % ends.size()];
+	    const Point& b = ends[(run + 1) % ends.size()];
+	    spans.clear();
+	    // Width 0 stands for the anti-aliased line
+	    if (width == 0) {
+		coverage.clear();
+		rasterize_line_aa(a.x, a.y, b.x, b.y, size.width, size.height, spans, coverage);
+		canvas.paint_spans(spans, coverage, COLOR_B, BRUSH_NORMAL);
+	    }
+	    else {
+		rasterize_thick_line(a.x, a.y, b.x, b.y, width, size.width, size.height, spans);
+		canvas.fill_spans(spans, COLOR_B);
+	    }
+	}, 100);
+	std::string name = width == 0 ? "lines_aa" : "lines_width_" + std::to_string(width);
+	report(name.c_str(), size, 1.0 / seconds, "lines/s");
+    }
+}
+
+// A star with 512 vertices over the whole canvas, like a detailed lasso: rasterizing it per row
+// and filling it into the canvas
+void bench_polygon(Bench_Size size) {
+    Canvas canvas;
+    canvas.init(size.width, size.height, COLOR_A);
+    std::vector<Point> points;
+    for (int i = 0; i < 512; i++) {
+	float radius = (i % 2 ? 0.5f : 0.2f) * std::min(size.width, size.height);
+	float angle = i * 2.f * PI / 512;
+	points.push_back({size.width / 2 + (int)(cosf(angle) * radius), size.height / 2 + (int)(sinf(angle) * radius)});
+    }
+    std::vector<Span> spans;
+    double seconds = time_runs([&](int) {
+	spans.clear();
+	rasterize_polygon(points, spans);
+    }, 2);
+    u64 pixels = 0;
+    for (const Span& span : spans) pixels += span.x1 - span.x0;
+    int rows = spans.empty() ? 1 : spans.back().y - spans.front().y + 1;
+    report("polygon_rasterize", size, seconds * 1e6 / rows, "us/row");
+    seconds = time_runs([&](int run) {
+	spans.clear();
+	rasterize_polygon(points, spans);
+	canvas.fill_spans(spans, run % 2 ? COLOR_A : COLOR_B);
+    }, 2);
+    report("polygon_fill", size, pixels / seconds / 1e6, "Mpx/s");
+}
+
+// Rubber-banding a line from the canvas center to a point circling the canvas, once per frame.
+// copy: what draw_preview_line used to do, copy the whole canvas, draw the line into the copy
+// and upload the copy. overlay: rasterize the line into spans drawn on top of the texture.
+void bench_line_preview(Bench_Size size) {
+    Canvas canvas;
+    canvas.init(size.width, size.height, COLOR_A);
+    std::vector<u32> preview((u64)size.width * size.height);
+    std::vector<Span> spans;
+    int center_x = size.width / 2;
+    int center_y = size.height / 2;
+    float radius = std::min(size.width, size.height) / 2 - 1;
+
+    for (int copy = 1; copy >= 0; copy--) {
+	double seconds = time_runs([&](int frame) {
+	    float angle = frame * 0.05f;
+	    int end_x = center_x + (int)(cosf(angle) * radius);
+	    int end_y = center_y + (int)(sinf(angle) * radius);
+	    spans.clear();
+	    rasterize_line(center_x, center_y, end_x, end_y, spans);
+	    if (copy) {
+		canvas.copy_to_linear(preview.data());
+		for (const Span& span : spans) {
+		    for (int x = span.x0; x < span.x1; x++) preview[(u64)span.y * size.width + x] = COLOR_B;
+		}
+		sink += preview[(u64)end_y * size.width + end_x];
+	    }
+	    else sink += spans.size();
+	}, 10);
+	report(copy ? "line_preview_copy" : "line_preview_overlay", size, seconds * 1e6, "us/frame");
+    }
+    report("line_preview_copy_upload", size, (double)preview.size() * sizeof(u32), "bytes/frame");
+    report("line_preview_overlay_upload", size, 0, "bytes/frame");
+}
+
+// Bytes the texture upload sends after typical edits, compared to re-uploading the whole image
+void bench_upload(Bench_Size size) {
+    Editor editor;
+    editor.init(size.width, size.height, COLOR_A);
+    take_dirty_bytes(editor.canvas());
+    report("upload_full_image", size, (double)size.width * size.height * sizeof(u32), "bytes");
+    editor.set_pixel(size.width / 2, size.height / 2, COLOR_B);
+    report("upload_set_pixel", size, take_dirty_bytes(editor.canvas()), "bytes");
+    editor.draw_line(0, 0, size.width / 4, size.height / 4, COLOR_B);
+    report("upload_line", size, take_dirty_bytes(editor.canvas()), "bytes");
+    editor.fill(size.width - 1, size.height - 1, WALL);
+    report("upload_fill", size, take_dirty_bytes(editor.canvas()), "bytes");
+}
+
+// Recompositing a layer stack with every blend mode in use, at each SIMD level.
+// full: every layer is blended again. paint_middle: only the middle layer changed, blended
+// between the cached layers below and above it.
+void bench_composite(Bench_Size size, int layer_count) {
+    Editor editor;
+    editor.init(size.width, size.height, COLOR_A);
+    srand(2);
+    for (int i = 1; i < layer_count; i++) {
+	editor.add_layer();
+	for (u32& pixel : editor.canvas().pixels) pixel = (u32)rand() << 16 ^ (u32)rand();
+	editor.set_opacity(200);
+	// Normal layers on top so the layers above the middle can be flattened
+	editor.set_blend(i < layer_count / 2 ? (Blend_Mode)(i % BLEND_MODE_MAX) : BLEND_NORMAL);
+    }
+    editor.select_layer(layer_count / 2);
+    for (int level = SIMD_SCALAR; level <= simd_supported(); level++) {
+	set_simd_level((Simd_Level)level);
+	std::string name = "composite_" + std::to_string(layer_count) + "_layers_";
+	double seconds = time_runs([&](int) {
+	    editor.invalidate_cache();
+	    editor.update_composite();
+	});
+	report((name + "full_" + simd_level_as_string((Simd_Level)level)).c_str(), size,
+	       (double)size.width * size.height / seconds / 1e6, "Mpx/s");
+	seconds = time_runs([&](int) {
+	    std::fill(editor.canvas().dirty.begin(), editor.canvas().dirty.end(), 1);
+	    editor.update_composite();
+	});
+	report((name + "paint_middle_" + simd_level_as_string((Simd_Level)level)).c_str(), size,
+	       (double)size.width * size.height / seconds / 1e6, "Mpx/s");
+    }
+    set_simd_level(simd_supported());
+}
+
+#ifdef SPRITE_PAINT_BENCH_EXPORT
+// Same work as the export worker: convert to a linear image, encode and write the PNG
+void bench_export(Bench_Size size) {
+    Canvas canvas;
+    canvas.init(size.width, size.height, COLOR_A);
+    make_maze(canvas);
+    std::vector<u32> pixels((u64)size.width * size.height);
+    const char* path = "sprite_paint_bench.png";
+    double seconds = time_runs([&](int) {
+	canvas.copy_to_linear(pixels.data());
+	Image img = {pixels.data(), size.width, size.height, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+	sink += ExportImage(img, path);
+    });
+    remove(path);
+    report("export_png", size, seconds * 1e3, "ms");
+}
+#endif
+
+void print_json() {
+    printf("{\n  \"benchmarks\": [\n");
+    for (u64 i = 0; i < results.size(); i++) {
+	const Result& result = results[i];
+	printf("    {\"name\": \"%s\", \"width\": %d, \"height\": %d, \"value\": %.6g, \"unit\": \"%s\"}%s\n",
+	       result.name.c_str(), result.size.width, result.size.height, result.value, result.unit,
+	       i + 1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char** argv) {
+    int max_size = argc > 1 ? atoi(argv[1]) : 8192;
+#ifdef SPRITE_PAINT_BENCH_EXPORT
+    SetTraceLogLevel(LOG_WARNING);
+#endif
+    for (Bench_Size size : SIZES) {
+	if (size.width > max_size || size.height > max_size) continue;
+	bench_set_pixel(size);
+	bench_stroke(size);
+	bench_fill("fill_empty", size, nullptr);
+	bench_fill("fill_maze", size, make_maze);
+	bench_fill("fill_comb", size, make_comb);
+	bench_fill_tolerance(size);
+	if (size.width >= 1024) {
+	    bench_fill_parallel("empty", size, nullptr);
+	    bench_fill_parallel("maze", size, make_maze);
+	    bench_fill_parallel("comb", size, make_comb);
+	}
+	bench_labels("maze", size, make_maze);
+	bench_labels("comb", size, make_comb);
+	bench_line_preview(size);
+	bench_shapes(size);
+	bench_polygon(size);
+	bench_lines(size);
+	bench_history(size);
+	bench_branches(size);
+	bench_journal(size);
+	bench_upload(size);
+#ifdef SPRITE_PAINT_BENCH_EXPORT
+	bench_export(size);
+#endif
+    }
+    // Layer stacks get big quickly, composite and brushes at one size only
+    Bench_Size composite_size = {1024, 1024};
+    if (composite_size.width <= max_size) {
+	for (int layer_count : {2, 8, 32}) bench_composite(composite_size, layer_count);
+	bench_brush(composite_size);
+	bench_symmetry(composite_size);
+    }
+    Bench_Size replace_size = {4096, 4096};
+    if (replace_size.width <= max_size) bench_replace(replace_size);
+    print_json();
+    return 0;
+}
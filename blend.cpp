@@ -0,0 +1,626 @@
+#include "blend.hpp"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BLEND_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(BLEND_X86) && defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+const char* blend_mode_as_string(Blend_Mode mode) {
+    switch (mode) {
+    case BLEND_NORMAL:
+	return "Normal";
+    case BLEND_MULTIPLY:
+	return "Multiply";
+    case BLEND_SCREEN:
+	return "Screen";
+    case BLEND_MODE_MAX:
+	assert(0);
+    }
+    assert(0);
+    return "";
+}
+
+const char* brush_mode_as_string(Brush_Mode mode) {
+    switch (mode) {
+    case BRUSH_NORMAL:
+	return "Normal";
+    case BRUSH_BLEND:
+	return "Blend";
+    case BRUSH_ERASE:
+	return "Erase";
+    case BRUSH_MODE_MAX:
+	assert(0);
+    }
+    assert(0);
+    return "";
+}
+
+const char* color_metric_as_string(Color_Metric metric) {
+    switch (metric) {
+    case METRIC_CHANNEL:
+	return "Channel";
+    case METRIC_EUCLIDEAN:
+	return "Euclidean";
+    case METRIC_MAX:
+	assert(0);
+    }
+    assert(0);
+    return "";
+}
+
+const char* simd_level_as_string(Simd_Level level) {
+    switch (level) {
+    case SIMD_SCALAR:
+	return "scalar";
+    case SIMD_SSE2:
+	return "sse2";
+    case SIMD_AVX2:
+	return "avx2";
+    }
+    assert(0);
+    return "";
+}
+
+Simd_Level simd_supported() {
+#if defined(BLEND_X86) && defined(__GNUC__)
+    static Simd_Level level = __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+    return level;
+#elif defined(BLEND_X86) && defined(_MSC_VER)
+    static Simd_Level level = []() {
+	int info[4];
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) ? SIMD_AVX2 : SIMD_SSE2;
+    }();
+    return level;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+static Simd_Level current_level = simd_supported();
+
+Simd_Level simd_level() {
+    return current_level;
+}
+
+void set_simd_level(Simd_Level level) {
+    current_level = std::min(level, simd_supported());
+}
+
+// Exact round(x / 255) for x <= 255 * 255
+inline u32 div255(u32 x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+// All kernels work on premultiplied values:
+//   a = src alpha * opacity, cs = src * a, cb / ab = dst color / alpha
+//   normal:   cs + cb * (1 - a)
+//   multiply: cs * (1 - ab) + cb * (1 - a) + cs * cb
+//   screen:   cs + cb - cs * cb
+// The alpha channel goes through the same formula as the colors.
+template<Blend_Mode mode>
+void blend_span_scalar(u32* dst, const u32* src, int count, u8 opacity) {
+    for (int i = 0; i < count; i++) {
+	u8* d = (u8*)(dst + i);
+	const u8* s = (const u8*)(src + i);
+	u32 a = div255(s[3] * opacity);
+	u32 ab = d[3];
+	for (int c = 0; c < 4; c++) {
+	    u32 cs = c == 3 ? a : div255(s[c] * a);
+	    u32 cb = d[c];
+	    u32 out;
+	    if (mode == BLEND_NORMAL) out = cs + div255(cb * (255 - a));
+	    else if (mode == BLEND_MULTIPLY) out = div255(cs * (255 - ab)) + div255(cb * (255 - a)) + div255(cs * cb);
+	    else out = cs + cb - div255(cs * cb);
+	    d[c] = std::min(out, 255u);
+	}
+    }
+}
+
+void over_span_scalar(u32* dst, const u32* src, int count) {
+    for (int i = 0; i < count; i++) {
+	u8* d = (u8*)(dst + i);
+	const u8* s = (const u8*)(src + i);
+	for (int c = 0; c < 4; c++) d[c] = std::min(s[c] + div255(d[c] * (255 - s[3])), 255u);
+    }
+}
+
+// Brush kernels work on straight alpha, c = coverage, s = color:
+//   normal: s * c + d * (1 - c) for all four channels
+//   erase:  alpha * (1 - c)
+//   blend:  a = sa * c, alpha = a + da * (1 - a) and the colors are the average of s and d
+//           weighted by a and da * (1 - a). The weights are exact integers and the products
+//           stay below 2^24, so the float math is exact up to the single division.
+template<Brush_Mode mode>
+void paint_span_scalar(u32* dst, const u8* coverage, int count, u32 color) {
+    const u8* s = (const u8*)&color;
+    for (int i = 0; i < count; i++) {
+	u8* d = (u8*)(dst + i);
+	u32 c = coverage[i];
+	if (mode == BRUSH_NORMAL) {
+	    for (int ch = 0; ch < 4; ch++) d[ch] = div255(s[ch] * c + d[ch] * (255 - c));
+	}
+	else if (mode == BRUSH_ERASE) d[3] = div255(d[3] * (255 - c));
+	else {
+	    u32 a = div255(s[3] * c);
+	    u32 ws = a * 255;
+	    u32 wd = d[3] * (255 - a);
+	    float total = (float)std::max(ws + wd, 1u);
+	    for (int ch = 0; ch < 3; ch++) d[ch] = (u32)(((float)s[ch] * (float)ws + (float)d[ch] * (float)wd) / total + 0.5f);
+	    d[3] = a + div255(wd);
+	}
+    }
+}
+
+u64 match_exact_scalar(const u32* src, int count, u32 target) {
+    u64 mask = 0;
+    for (int i = 0; i < count; i++) mask |= (u64)(src[i] == target) << i;
+    return mask;
+}
+
+template<Color_Metric metric>
+u64 match_span_scalar(const u32* src, int count, u32 target, int tolerance) {
+    u64 mask = 0;
+    for (int i = 0; i < count; i++) mask |= (u64)color_matches(src[i], target, tolerance, metric) << i;
+    return mask;
+}
+
+#ifdef BLEND_X86
+inline __m128i div255_sse2(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+inline __m128i broadcast_alpha_sse2(__m128i x) {
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+// Two pixels as 16 bit channels
+template<Blend_Mode mode>
+inline __m128i blend_sse2(__m128i d, __m128i s, __m128i opacity) {
+    const __m128i alpha_255 = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+    const __m128i all_255 = _mm_set1_epi16(255);
+    __m128i a = div255_sse2(_mm_mullo_epi16(broadcast_alpha_sse2(s), opacity));
+    // An alpha of 255 turns the multiply into cs = a for the alpha channel
+    __m128i cs = div255_sse2(_mm_mullo_epi16(_mm_or_si128(s, alpha_255), a));
+    __m128i inv_a = _mm_sub_epi16(all_255, a);
+    if (mode == BLEND_NORMAL) {
+	return _mm_add_epi16(cs, div255_sse2(_mm_mullo_epi16(d, inv_a)));
+    }
+    if (mode == BLEND_MULTIPLY) {
+	__m128i inv_ab = _mm_sub_epi16(all_255, broadcast_alpha_sse2(d));
+	__m128i out = _mm_add_epi16(div255_sse2(_mm_mullo_epi16(cs, inv_ab)), div255_sse2(_mm_mullo_epi16(d, inv_a)));
+	return _mm_add_epi16(out, div255_sse2(_mm_mullo_epi16(cs, d)));
+    }
+    return _mm_sub_epi16(_mm_add_epi16(cs, d), div255_sse2(_mm_mullo_epi16(cs, d)));
+}
+
+template<Blend_Mode mode>
+void blend_span_sse2(u32* dst, const u32* src, int count, u8 opacity) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i op = _mm_set1_epi16(opacity);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+	__m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+	__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+	__m128i lo = blend_sse2<mode>(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero), op);
+	__m128i hi = blend_sse2<mode>(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero), op);
+	_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    blend_span_scalar<mode>(dst + i, src + i, count - i, opacity);
+}
+
+inline __m128i over_sse2(__m128i d, __m128i s) {
+    __m128i inv_a = _mm_sub_epi16(_mm_set1_epi16(255), broadcast_alpha_sse2(s));
+    return _mm_add_epi16(s, div255_sse2(_mm_mullo_epi16(d, inv_a)));
+}
+
+void over_span_sse2(u32* dst, const u32* src, int count) {
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+	__m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+	__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+	__m128i lo = over_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero));
+	__m128i hi = over_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero));
+	_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    over_span_scalar(dst + i, src + i, count - i);
+}
+
+inline __m128i div255_epi32_sse2(__m128i x) {
+    x = _mm_add_epi32(x, _mm_set1_epi32(128));
+    return _mm_srli_epi32(_mm_add_epi32(x, _mm_srli_epi32(x, 8)), 8);
+}
+
+// Four coverage bytes, one per 32 bit lane
+inline __m128i load_coverage_sse2(const u8* coverage) {
+    u32 c;
+    memcpy(&c, coverage, sizeof(c));
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(c), zero), zero);
+}
+
+// Normal and erase on two pixels as 16 bit channels, c holds each pixel's coverage in all four channels
+template<Brush_Mode mode>
+inline __m128i paint_sse2(__m128i d, __m128i s, __m128i c) {
+    const __m128i all_255 = _mm_set1_epi16(255);
+    if (mode == BRUSH_NORMAL) {
+	return div255_sse2(_mm_add_epi16(_mm_mullo_epi16(s, c), _mm_mullo_epi16(d, _mm_sub_epi16(all_255, c))));
+    }
+    // d * 255 / 255 leaves the colors as they are
+    const __m128i alpha = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    return div255_sse2(_mm_mullo_epi16(d, _mm_sub_epi16(all_255, _mm_and_si128(c, alpha))));
+}
+
+// Blend on four pixels with one channel per 32 bit lane, the same steps as paint_span_scalar.
+// Every product fits in 16 bits, so mullo_epi16 works on the zero extended lanes.
+inline __m128i paint_blend_sse2(__m128i d, __m128i c, u32 color) {
+    const __m128i low_byte = _mm_set1_epi32(0xFF);
+    const __m128i all_255 = _mm_set1_epi32(255);
+    __m128i a = div255_epi32_sse2(_mm_mullo_epi16(c, _mm_set1_epi32(color >> 24)));
+    __m128i da = _mm_srli_epi32(d, 24);
+    __m128i ws = _mm_mullo_epi16(a, all_255);
+    __m128i wd = _mm_mullo_epi16(da, _mm_sub_epi32(all_255, a));
+    __m128i total = _mm_add_epi32(ws, wd);
+    total = _mm_or_si128(total, _mm_and_si128(_mm_cmpeq_epi32(total, _mm_setzero_si128()), _mm_set1_epi32(1)));
+    __m128 f_total = _mm_cvtepi32_ps(total);
+    __m128 f_ws = _mm_cvtepi32_ps(ws);
+    __m128 f_wd = _mm_cvtepi32_ps(wd);
+    __m128i out = _mm_slli_epi32(_mm_add_epi32(a, div255_epi32_sse2(wd)), 24);
+    for (int ch = 0; ch < 3; ch++) {
+	__m128 s = _mm_set1_ps((float)((color >> (8 * ch)) & 0xFF));
+	__m128 dc = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(d, 8 * ch), low_byte));
+	__m128 sum = _mm_add_ps(_mm_mul_ps(s, f_ws), _mm_mul_ps(dc, f_wd));
+	__m128i v = _mm_cvttps_epi32(_mm_add_ps(_mm_div_ps(sum, f_total), _mm_set1_ps(0.5f)));
+	out = _mm_or_si128(out, _mm_slli_epi32(v, 8 * ch));
+    }
+    return out;
+}
+
+template<Brush_Mode mode>
+void paint_span_sse2(u32* dst, const u8* coverage, int count, u32 color) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i s = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+	__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+	__m128i c = load_coverage_sse2(coverage + i);
+	if (mode == BRUSH_BLEND) {
+	    _mm_storeu_si128((__m128i*)(dst + i), paint_blend_sse2(d, c, color));
+	    continue;
+	}
+	// Coverage into both halves of its lane, then each lane twice: c0 c0 c0 c0 c1 c1 c1 c1
+	c = _mm_or_si128(c, _mm_slli_epi32(c, 16));
+	__m128i lo = paint_sse2<mode>(_mm_unpacklo_epi8(d, zero), s, _mm_unpacklo_epi32(c, c));
+	__m128i hi = paint_sse2<mode>(_mm_unpackhi_epi8(d, zero), s, _mm_unpackhi_epi32(c, c));
+	_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    paint_span_scalar<mode>(dst + i, coverage + i, count - i, color);
+}
+
+u64 match_exact_sse2(const u32* src, int count, u32 target) {
+    const __m128i t = _mm_set1_epi32(target);
+    u64 mask = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+	__m128i p = _mm_loadu_si128((const __m128i*)(src + i));
+	mask |= (u64)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(p, t))) << i;
+    }
+    if (i < count) mask |= match_exact_scalar(src + i, count - i, target) << i;
+    return mask;
+}
+
+// Channel: the saturated differences minus the tolerance are all zero.
+// Euclidean: the squared differences summed pairwise by madd, then the two halves of each pixel.
+template<Color_Metric metric>
+u64 match_span_sse2(const u32* src, int count, u32 target, int tolerance) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i t = _mm_set1_epi32(target);
+    const __m128i channel_limit = _mm_set1_epi8((char)std::min(tolerance, 255));
+    const __m128i squared_limit = _mm_set1_epi32(tolerance * tolerance);
+    u64 mask = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+	__m128i p = _mm_loadu_si128((const __m128i*)(src + i));
+	__m128i diff = _mm_or_si128(_mm_subs_epu8(p, t), _mm_subs_epu8(t, p));
+	int bits;
+	if (metric == METRIC_CHANNEL) {
+	    __m128i over = _mm_subs_epu8(diff, channel_limit);
+	    bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(over, zero)));
+	}
+	else {
+	    __m128 lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(diff, zero), _mm_unpacklo_epi8(diff, zero)));
+	    __m128 hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(diff, zero), _mm_unpackhi_epi8(diff, zero)));
+	    __m128i sum = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+					_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))));
+	    bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(sum, squared_limit))) ^ 0xF;
+	}
+	mask |= (u64)bits << i;
+    }
+    if (i < count) mask |= match_span_scalar<metric>(src + i, count - i, target, tolerance) << i;
+    return mask;
+}
+
+TARGET_AVX2 inline __m256i div255_avx2(__m256i x) {
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+TARGET_AVX2 inline __m256i broadcast_alpha_avx2(__m256i x) {
+    return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+// Four pixels as 16 bit channels, same steps as blend_sse2
+template<Blend_Mode mode>
+TARGET_AVX2 inline __m256i blend_avx2(__m256i d, __m256i s, __m256i opacity) {
+    const __m256i alpha_255 = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0);
+    const __m256i all_255 = _mm256_set1_epi16(255);
+    __m256i a = div255_avx2(_mm256_mullo_epi16(broadcast_alpha_avx2(s), opacity));
+    __m256i cs = div255_avx2(_mm256_mullo_epi16(_mm256_or_si256(s, alpha_255), a));
+    __m256i inv_a = _mm256_sub_epi16(all_255, a);
+    if (mode == BLEND_NORMAL) {
+	return _mm256_add_epi16(cs, div255_avx2(_mm256_mullo_epi16(d, inv_a)));
+    }
+    if (mode == BLEND_MULTIPLY) {
+	__m256i inv_ab = _mm256_sub_epi16(all_255, broadcast_alpha_avx2(d));
+	__m256i out = _mm256_add_epi16(div255_avx2(_mm256_mullo_epi16(cs, inv_ab)), div255_avx2(_mm256_mullo_epi16(d, inv_a)));
+	return _mm256_add_epi16(out, div255_avx2(_mm256_mullo_epi16(cs, d)));
+    }
+    return _mm256_sub_epi16(_mm256_add_epi16(cs, d), div255_avx2(_mm256_mullo_epi16(cs, d)));
+}
+
+template<Blend_Mode mode>
+TARGET_AVX2 void blend_span_avx2(u32* dst, const u32* src, int count, u8 opacity) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i op = _mm256_set1_epi16(opacity);
+    int i = 0;
+    // Unpack and pack both work within 128 bit lanes, so the pixel order survives the round trip
+    for (; i + 8 <= count; i += 8) {
+	__m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+	__m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+	__m256i lo = blend_avx2<mode>(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero), op);
+	__m256i hi = blend_avx2<mode>(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero), op);
+	_mm256_storeu_si256((__m256i*)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+    // The compiler turns the tail call into a jump without clearing the upper halves, which
+    // makes every SSE instruction after it pay for the AVX to SSE transition
+    _mm256_zeroupper();
+    blend_span_sse2<mode>(dst + i, src + i, count - i, opacity);
+}
+
+TARGET_AVX2 inline __m256i over_avx2(__m256i d, __m256i s) {
+    __m256i inv_a = _mm256_sub_epi16(_mm256_set1_epi16(255), broadcast_alpha_avx2(s));
+    return _mm256_add_epi16(s, div255_avx2(_mm256_mullo_epi16(d, inv_a)));
+}
+
+TARGET_AVX2 void over_span_avx2(u32* dst, const u32* src, int count) {
+    const __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+	__m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+	__m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+	__m256i lo = over_avx2(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero));
+	__m256i hi = over_avx2(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero));
+	_mm256_storeu_si256((__m256i*)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+    _mm256_zeroupper();
+    over_span_sse2(dst + i, src + i, count - i);
+}
+
+TARGET_AVX2 inline __m256i div255_epi32_avx2(__m256i x) {
+    x = _mm256_add_epi32(x, _mm256_set1_epi32(128));
+    return _mm256_srli_epi32(_mm256_add_epi32(x, _mm256_srli_epi32(x, 8)), 8);
+}
+
+// Same steps as paint_sse2
+template<Brush_Mode mode>
+TARGET_AVX2 inline __m256i paint_avx2(__m256i d, __m256i s, __m256i c) {
+    const __m256i all_255 = _mm256_set1_epi16(255);
+    if (mode == BRUSH_NORMAL) {
+	return div255_avx2(_mm256_add_epi16(_mm256_mullo_epi16(s, c), _mm256_mullo_epi16(d, _mm256_sub_epi16(all_255, c))));
+    }
+    const __m256i alpha = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0);
+    return div255_avx2(_mm256_mullo_epi16(d, _mm256_sub_epi16(all_255, _mm256_and_si256(c, alpha))));
+}
+
+// Same steps as paint_blend_sse2 on eight pixels
+TARGET_AVX2 inline __m256i paint_blend_avx2(__m256i d, __m256i c, u32 color) {
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    const __m256i all_255 = _mm256_set1_epi32(255);
+    __m256i a = div255_epi32_avx2(_mm256_mullo_epi32(c, _mm256_set1_epi32(color >> 24)));
+    __m256i da = _mm256_srli_epi32(d, 24);
+    __m256i ws = _mm256_mullo_epi32(a, all_255);
+    __m256i wd = _mm256_mullo_epi32(da, _mm256_sub_epi32(all_255, a));
+    __m256i total = _mm256_max_epi32(_mm256_add_epi32(ws, wd), _mm256_set1_epi32(1));
+    __m256 f_total = _mm256_cvtepi32_ps(total);
+    __m256 f_ws = _mm256_cvtepi32_ps(ws);
+    __m256 f_wd = _mm256_cvtepi32_ps(wd);
+    __m256i out = _mm256_slli_epi32(_mm256_add_epi32(a, div255_epi32_avx2(wd)), 24);
+    for (int ch = 0; ch < 3; ch++) {
+	__m256 s = _mm256_set1_ps((float)((color >> (8 * ch)) & 0xFF));
+	__m256 dc = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(d, 8 * ch), low_byte));
+	__m256 sum = _mm256_add_ps(_mm256_mul_ps(s, f_ws), _mm256_mul_ps(dc, f_wd));
+	__m256i v = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_div_ps(sum, f_total), _mm256_set1_ps(0.5f)));
+	out = _mm256_or_si256(out, _mm256_slli_epi32(v, 8 * ch));
+    }
+    return out;
+}
+
+template<Brush_Mode mode>
+TARGET_AVX2 void paint_span_avx2(u32* dst, const u8* coverage, int count, u32 color) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i s = _mm256_unpacklo_epi8(_mm256_set1_epi32(color), zero);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+	__m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+	__m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(coverage + i)));
+	if (mode == BRUSH_BLEND) {
+	    _mm256_storeu_si256((__m256i*)(dst + i), paint_blend_avx2(d, c, color));
+	    continue;
+	}
+	// Unpacking within 128 bit lanes gives pixels 0 1 4 5 and 2 3 6 7, which is also
+	// the order unpacking the coverage lanes produces
+	c = _mm256_or_si256(c, _mm256_slli_epi32(c, 16));
+	__m256i lo = paint_avx2<mode>(_mm256_unpacklo_epi8(d, zero), s, _mm256_unpacklo_epi32(c, c));
+	__m256i hi = paint_avx2<mode>(_mm256_unpackhi_epi8(d, zero), s, _mm256_unpackhi_epi32(c, c));
+	_mm256_storeu_si256((__m256i*)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+    _mm256_zeroupper();
+    paint_span_sse2<mode>(dst + i, coverage + i, count - i, color);
+}
+
+TARGET_AVX2 u64 match_exact_avx2(const u32* src, int count, u32 target) {
+    const __m256i t = _mm256_set1_epi32(target);
+    u64 mask = 0;
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+	__m256i p = _mm256_loadu_si256((const __m256i*)(src + i));
+	mask |= (u64)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(p, t))) << i;
+    }
+    _mm256_zeroupper();
+    if (i < count) mask |= match_exact_scalar(src + i, count - i, target) << i;
+    return mask;
+}
+
+// Same steps as match_span_sse2. The in-lane unpacks and shuffles put the pixel sums back in order.
+template<Color_Metric metric>
+TARGET_AVX2 u64 match_span_avx2(const u32* src, int count, u32 target, int tolerance) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i t = _mm256_set1_epi32(target);
+    const __m256i channel_limit = _mm256_set1_epi8((char)std::min(tolerance, 255));
+    const __m256i squared_limit = _mm256_set1_epi32(tolerance * tolerance);
+    u64 mask = 0;
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+	__m256i p = _mm256_loadu_si256((const __m256i*)(src + i));
+	__m256i diff = _mm256_or_si256(_mm256_subs_epu8(p, t), _mm256_subs_epu8(t, p));
+	int bits;
+	if (metric == METRIC_CHANNEL) {
+	    __m256i over = _mm256_subs_epu8(diff, channel_limit);
+	    bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(over, zero)));
+	}
+	else {
+	    __m256 lo = _mm256_castsi256_ps(_mm256_madd_epi16(_mm256_unpacklo_epi8(diff, zero), _mm256_unpacklo_epi8(diff, zero)));
+	    __m256 hi = _mm256_castsi256_ps(_mm256_madd_epi16(_mm256_unpackhi_epi8(diff, zero), _mm256_unpackhi_epi8(diff, zero)));
+	    __m256i sum = _mm256_add_epi32(_mm256_castps_si256(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))),
+					   _mm256_castps_si256(_mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))));
+	    bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(sum, squared_limit))) ^ 0xFF;
+	}
+	mask |= (u64)bits << i;
+    }
+    _mm256_zeroupper();
+    if (i < count) mask |= match_span_sse2<metric>(src + i, count - i, target, tolerance) << i;
+    return mask;
+}
+#endif
+
+template<Blend_Mode mode>
+void blend_span_mode(u32* dst, const u32* src, int count, u8 opacity) {
+#ifdef BLEND_X86
+    if (current_level == SIMD_AVX2) return blend_span_avx2<mode>(dst, src, count, opacity);
+    if (current_level == SIMD_SSE2) return blend_span_sse2<mode>(dst, src, count, opacity);
+#endif
+    blend_span_scalar<mode>(dst, src, count, opacity);
+}
+
+void blend_span(u32* dst, const u32* src, int count, u8 opacity, Blend_Mode mode) {
+    switch (mode) {
+    case BLEND_NORMAL:
+	return blend_span_mode<BLEND_NORMAL>(dst, src, count, opacity);
+    case BLEND_MULTIPLY:
+	return blend_span_mode<BLEND_MULTIPLY>(dst, src, count, opacity);
+    case BLEND_SCREEN:
+	return blend_span_mode<BLEND_SCREEN>(dst, src, count, opacity);
+    case BLEND_MODE_MAX:
+	assert(0);
+    }
+}
+
+template<Brush_Mode mode>
+void paint_span_mode(u32* dst, const u8* coverage, int count, u32 color) {
+#ifdef BLEND_X86
+    if (current_level == SIMD_AVX2) return paint_span_avx2<mode>(dst, coverage, count, color);
+    if (current_level == SIMD_SSE2) return paint_span_sse2<mode>(dst, coverage, count, color);
+#endif
+    paint_span_scalar<mode>(dst, coverage, count, color);
+}
+
+void paint_span(u32* dst, const u8* coverage, int count, u32 color, Brush_Mode mode) {
+    switch (mode) {
+    case BRUSH_NORMAL:
+	return paint_span_mode<BRUSH_NORMAL>(dst, coverage, count, color);
+    case BRUSH_BLEND:
+	return paint_span_mode<BRUSH_BLEND>(dst, coverage, count, color);
+    case BRUSH_ERASE:
+	return paint_span_mode<BRUSH_ERASE>(dst, coverage, count, color);
+    case BRUSH_MODE_MAX:
+	assert(0);
+    }
+}
+
+template<Color_Metric metric>
+u64 match_span_metric(const u32* src, int count, u32 target, int tolerance) {
+    // Runs next to walls are often a pixel or two, not worth the vector setup
+    if (count < 8) return match_span_scalar<metric>(src, count, target, tolerance);
+#ifdef BLEND_X86
+    if (current_level == SIMD_AVX2) return match_span_avx2<metric>(src, count, target, tolerance);
+    if (current_level == SIMD_SSE2) return match_span_sse2<metric>(src, count, target, tolerance);
+#endif
+    return match_span_scalar<metric>(src, count, target, tolerance);
+}
+
+u64 match_span(const u32* src, int count, u32 target, int tolerance, Color_Metric metric) {
+    assert(count <= 64);
+    // Both metrics only accept the exact color, which is one compare per pixel
+    if (tolerance == 0) {
+#ifdef BLEND_X86
+	if (count >= 8 && current_level == SIMD_AVX2) return match_exact_avx2(src, count, target);
+	if (count >= 4 && current_level >= SIMD_SSE2) return match_exact_sse2(src, count, target);
+#endif
+	return match_exact_scalar(src, count, target);
+    }
+    switch (metric) {
+    case METRIC_CHANNEL:
+	return match_span_metric<METRIC_CHANNEL>(src, count, target, tolerance);
+    case METRIC_EUCLIDEAN:
+	return match_span_metric<METRIC_EUCLIDEAN>(src, count, target, tolerance);
+    case METRIC_MAX:
+	assert(0);
+    }
+    return 0;
+}
+
+void over_span(u32* dst, const u32* src, int count) {
+#ifdef BLEND_X86
+    if (current_level == SIMD_AVX2) return over_span_avx2(dst, src, count);
+    if (current_level == SIMD_SSE2) return over_span_sse2(dst, src, count);
+#endif
+    over_span_scalar(dst, src, count);
+}
+
+void unpremultiply_span(u32* dst, const u32* src, int count) {
+    for (int i = 0; i < count; i++) {
+	const u8* s = (const u8*)(src + i);
+	u8* d = (u8*)(dst + i);
+	u32 a = s[3];
+	if (a == 0) {
+	    dst[i] = 0;
+	    continue;
+	}
+	for (int c = 0; c < 3; c++) d[c] = std::min((s[c] * 255 + a / 2) / a, 255u);
+	d[3] = a;
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "common.hpp"
+#include <algorithm>
+#include <cstdlib>
+
+enum Blend_Mode {
+    BLEND_NORMAL, BLEND_MULTIPLY, BLEND_SCREEN, BLEND_MODE_MAX
+};
+
+// How a brush stamp changes the straight alpha pixels under it
+enum Brush_Mode {
+    BRUSH_NORMAL, BRUSH_BLEND, BRUSH_ERASE, BRUSH_MODE_MAX
+};
+
+// Distance between two colors when matching them against a tolerance
+//   channel:   the largest difference of any channel
+//   euclidean: the length of the RGBA difference, up to 510
+enum Color_Metric {
+    METRIC_CHANNEL, METRIC_EUCLIDEAN, METRIC_MAX
+};
+
+enum Simd_Level {
+    SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2
+};
+
+const char* blend_mode_as_string(Blend_Mode mode);
+const char* brush_mode_as_string(Brush_Mode mode);
+const char* color_metric_as_string(Color_Metric metric);
+const char* simd_level_as_string(Simd_Level level);
+
+// Best level the CPU supports, detected once
+Simd_Level simd_supported();
+// Level the kernels use, defaults to simd_supported(). Lowering it is for benchmarks.
+Simd_Level simd_level();
+void set_simd_level(Simd_Level level);
+
+// Blends count straight alpha src pixels onto premultiplied dst pixels. The src alpha is
+// scaled by opacity first. Every level produces exactly the same result.
+void blend_span(u32* dst, const u32* src, int count, u8 opacity, Blend_Mode mode);
+// Premultiplied src over premultiplied dst
+void over_span(u32* dst, const u32* src, int count);
+// Premultiplied to straight alpha, dst and src may be the same
+void unpremultiply_span(u32* dst, const u32* src, int count);
+// Paints color onto count straight alpha dst pixels, coverage scales its strength per pixel.
+//   normal: moves every channel of dst towards color, full coverage writes color as is
+//   blend:  color over dst, alpha included
+//   erase:  lowers the alpha of dst, color is ignored
+// Every level produces exactly the same result.
+void paint_span(u32* dst, const u8* coverage, int count, u32 color, Brush_Mode mode);
+// Single pixel version of match_span, for callers that only look at a few pixels
+inline bool color_matches(u32 pixel, u32 target, int tolerance, Color_Metric metric) {
+    if (pixel == target) return true;
+    if (tolerance == 0) return false;
+    int distance = 0;
+    for (int c = 0; c < 32; c += 8) {
+	int diff = abs((int)(pixel >> c & 0xFF) - (int)(target >> c & 0xFF));
+	if (metric == METRIC_CHANNEL) distance = std::max(distance, diff);
+	else distance += diff * diff;
+    }
+    return distance <= (metric == METRIC_CHANNEL ? tolerance : tolerance * tolerance);
+}
+
+// Bit i is set when src[i] is within tolerance of target, count is at most 64.
+// A tolerance of 0 matches the exact color only.
+u64 match_span(const u32* src, int count, u32 target, int tolerance, Color_Metric metric);
@@ -0,0 +1,91 @@
+#include "brush.hpp"
+#include <algorithm>
+#include <cmath>
+
+const char* brush_shape_as_string(Brush_Shape shape) {
+    switch (shape) {
+    case BRUSH_SQUARE:
+	return "Square";
+    case BRUSH_ROUND:
+	return "Round";
+    case BRUSH_CUSTOM:
+	return "Custom";
+    case BRUSH_SHAPE_MAX:
+	assert(0);
+    }
+    assert(0);
+    return "";
+}
+
+void Brush::set_shape(Brush_Shape shape) {
+    // Without a custom stamp there is nothing to resample
+    if (shape == BRUSH_CUSTOM && custom.empty()) return;
+    this->shape = shape;
+    build();
+}
+
+void Brush::set_size(int size) {
+    this->size = std::min(std::max(size, MIN_BRUSH_SIZE), MAX_BRUSH_SIZE);
+    build();
+}
+
+void Brush::set_hardness(float hardness) {
+    this->hardness = std::min(std::max(hardness, 0.f), 1.f);
+    build();
+}
+
+bool Brush::set_custom(const u8* coverage, int size) {
+    if (size < MIN_BRUSH_SIZE || size > MAX_BRUSH_SIZE) return false;
+    custom.assign(coverage, coverage + size * size);
+    custom_size = size;
+    shape = BRUSH_CUSTOM;
+    build();
+    return true;
+}
+
+void Brush::build() {
+    mask.assign(size * size, 0);
+    float center = (size - 1) / 2.f;
+    float radius = size / 2.f;
+    float inner = radius * hardness;
+    for (int y = 0; y < size; y++) {
+	for (int x = 0; x < size; x++) {
+	    u8& coverage = mask[y * size + x];
+	    if (shape == BRUSH_SQUARE) coverage = 255;
+	    else if (shape == BRUSH_CUSTOM) coverage = custom[(y * custom_size / size) * custom_size + x * custom_size / size];
+	    else {
+		float distance = hypotf(x - center, y - center);
+		if (distance <= inner) coverage = 255;
+		else if (distance < radius) coverage = (u8)((radius - distance) / (radius - inner) * 255.f + 0.5f);
+	    }
+	}
+    }
+    rows.assign(size, {0, 0, 0});
+    for (int y = 0; y < size; y++) {
+	const u8* row = mask.data() + y * size;
+	int x0 = 0;
+	int x1 = size;
+	while (x0 < x1 && row[x0] == 0) x0++;
+	while (x1 > x0 && row[x1 - 1] == 0) x1--;
+	rows[y] = {y, x0, x1};
+    }
+}
+
+void Brush::stamp(Canvas& canvas, int x, int y, u32 color) const {
+    int left = x - size / 2;
+    int top = y - size / 2;
+    for (const Span& row : rows) {
+	int cy = top + row.y;
+	if (cy < 0 || cy >= canvas.height) continue;
+	int x0 = std::max(left + row.x0, 0);
+	int x1 = std::min(left + row.x1, canvas.width);
+	const u8* coverage = mask.data() + row.y * size + (x0 - left);
+	while (x0 < x1) {
+	    int run = std::min(TILE_SIZE - (x0 & (TILE_SIZE - 1)), x1 - x0);
+	    canvas.touch(canvas.tile_index(x0, cy));
+	    paint_span(canvas.pixels.data() + canvas.index(x0, cy), coverage, run, color, mode);
+	    coverage += run;
+	    x0 += run;
+	}
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "blend.hpp"
+#include "canvas.hpp"
+#include <algorithm>
+
+enum Brush_Shape {
+    BRUSH_SQUARE, BRUSH_ROUND, BRUSH_CUSTOM, BRUSH_SHAPE_MAX
+};
+
+const char* brush_shape_as_string(Brush_Shape shape);
+
+const int MIN_BRUSH_SIZE = 1;
+const int MAX_BRUSH_SIZE = 256;
+
+// A size x size coverage stamp centered on the pixel it is painted at, even sizes reach one
+// pixel further up and left. The mask is rebuilt whenever the shape, size or hardness change,
+// custom stamps are resampled from the coverage given to set_custom().
+struct Brush {
+    Brush_Shape shape = BRUSH_SQUARE;
+    Brush_Mode mode = BRUSH_NORMAL;
+    int size = 1;
+    // Part of the round brush's radius at full coverage, the rest fades out
+    float hardness = 1.f;
+    // size * size, row-major
+    std::vector<u8> mask;
+    // Covered part of each mask row, [x0, x1) in stamp coordinates. Empty rows have x0 == x1.
+    std::vector<Span> rows;
+    std::vector<u8> custom;
+    int custom_size = 0;
+    void set_shape(Brush_Shape shape);
+    void set_size(int size);
+    void set_hardness(float hardness);
+    // coverage is size * size, row-major. Returns false if size is out of range.
+    bool set_custom(const u8* coverage, int size);
+    void build();
+    // Distance between stamps along a stroke, close enough that soft edges don't show steps
+    int spacing() const { return std::max(1, size / 4); }
+    // Paints the stamp centered at (x, y), clipped to the canvas
+    void stamp(Canvas& canvas, int x, int y, u32 color) const;
+};
@@ -0,0 +1,319 @@
+#include "canvas.hpp"
+#include <algorithm>
+
+void Canvas::init(int width, int height, u32 color) {
+    this->width = width;
+    this->height = height;
+    tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    generation = 1;
+    pixels.assign((u64)tile_count() * TILE_PIXELS, color);
+    dirty.assign(tile_count(), 1);
+    tile_generation.assign(tile_count(), generation);
+}
+
+void Canvas::backup_tile(int tile) {
+    edit_tiles.push_back(tile);
+    const u32* src = this->tile(tile);
+    edit_backup.insert(edit_backup.end(), src, src + TILE_PIXELS);
+}
+
+void Canvas::begin_edit() {
+    assert(!editing);
+    editing = true;
+    edit_checkpoint = checkpoint();
+    edit_tiles.clear();
+    edit_backup.clear();
+}
+
+void Canvas::end_edit() {
+    editing = false;
+    edit_tiles.clear();
+    edit_backup.clear();
+}
+
+void Canvas::set(int x, int y, u32 color) {
+    if (!inside(x, y)) return;
+    touch(tile_index(x, y));
+    pixels[index(x, y)] = color;
+}
+
+void Canvas::fill_span(int y, int x0, int x1, u32 color) {
+    if (y < 0 || y >= height) return;
+    x0 = std::max(x0, 0);
+    x1 = std::min(x1, width);
+    while (x0 < x1) {
+	int run = std::min(TILE_SIZE - (x0 & (TILE_SIZE - 1)), x1 - x0);
+	touch(tile_index(x0, y));
+	u32* dst = pixels.data() + index(x0, y);
+	std::fill(dst, dst + run, color);
+	x0 += run;
+    }
+}
+
+void Canvas::fill_spans(const std::vector<Span>& spans, u32 color) {
+    for (const Span& span : spans) fill_span(span.y, span.x0, span.x1, color);
+}
+
+void Canvas::paint_spans(const std::vector<Span>& spans, const std::vector<u8>& coverage, u32 color, Brush_Mode mode) {
+    const u8* src = coverage.data();
+    for (const Span& span : spans) {
+	const u8* next = src + (span.x1 - span.x0);
+	if (span.y >= 0 && span.y < height) {
+	    int x0 = std::max(span.x0, 0);
+	    int x1 = std::min(span.x1, width);
+	    src += x0 - span.x0;
+	    while (x0 < x1) {
+		int run = std::min(TILE_SIZE - (x0 & (TILE_SIZE - 1)), x1 - x0);
+		touch(tile_index(x0, span.y));
+		paint_span(pixels.data() + index(x0, span.y), src, run, color, mode);
+		src += run;
+		x0 += run;
+	    }
+	}
+	src = next;
+    }
+}
+
+void Canvas::copy_to_linear(u32* dst) const {
+    for (int y = 0; y < height; y++) {
+	for (int x = 0; x < width; x += TILE_SIZE) {
+	    int run = std::min(TILE_SIZE, width - x);
+	    memcpy(dst + (u64)y * width + x, pixels.data() + index(x, y), run * sizeof(u32));
+	}
+    }
+}
+
+void Canvas::copy_from_linear(const u32* src) {
+    for (int y = 0; y < height; y++) {
+	for (int x = 0; x < width; x += TILE_SIZE) {
+	    int run = std::min(TILE_SIZE, width - x);
+	    touch(tile_index(x, y));
+	    memcpy(pixels.data() + index(x, y), src + (u64)y * width + x, run * sizeof(u32));
+	}
+    }
+}
+
+// Bits [from, to] of a word, both in 0..63
+inline u64 bit_range(int from, int to) {
+    return (~0ull >> (63 - to)) & (~0ull << from);
+}
+
+// Runs shorter than this are matched pixel by pixel, a call into the kernels costs more
+const int SCAN_WINDOW = 8;
+
+u64 Flood_Fill::open_pixels(const Canvas& canvas, int x0, int x1, int y, u32 target) const {
+    int base = x0 & ~(TILE_SIZE - 1);
+    const u32* src = canvas.pixels.data() + canvas.index(x0, y);
+    u64 matches = 0;
+    if (x1 - x0 < SCAN_WINDOW) {
+	for (int i = 0; i < x1 - x0; i++) matches |= (u64)color_matches(src[i], target, tolerance, metric) << i;
+    }
+    else matches = match_span(src, x1 - x0, target, tolerance, metric);
+    matches <<= x0 - base;
+    if (track_filled) matches &= ~filled[canvas.index(base, y) >> TILE_SHIFT];
+    return matches;
+}
+
+// Both scans check a few pixels one by one, most runs next to walls are short, then match
+// the rest of each tile row at once
+int Flood_Fill::scan_left(const Canvas& canvas, int x, int y, u32 target) const {
+    for (int i = 0; i < SCAN_WINDOW; i++) {
+	if (x == 0 || !is_open(canvas, x - 1, y, target)) return x;
+	x--;
+    }
+    while (x > 0) {
+	int from = (x - 1) & ~(TILE_SIZE - 1);
+	u64 closed = ~open_pixels(canvas, from, x, y, target) & bit_range(0, (x - 1) & (TILE_SIZE - 1));
+	if (closed) return from + highest_bit(closed) + 1;
+	x = from;
+    }
+    return x;
+}
+
+int Flood_Fill::scan_right(const Canvas& canvas, int x, int y, u32 target) const {
+    for (int i = 0; i < SCAN_WINDOW; i++) {
+	if (x + 1 == canvas.width || !is_open(canvas, x + 1, y, target)) return x;
+	x++;
+    }
+    while (x + 1 < canvas.width) {
+	int from = x + 1;
+	int to = std::min((from | (TILE_SIZE - 1)) + 1, canvas.width);
+	u64 closed = ~open_pixels(canvas, from, to, y, target) & bit_range(from & (TILE_SIZE - 1), (to - 1) & (TILE_SIZE - 1));
+	if (closed) return (from & ~(TILE_SIZE - 1)) + lowest_bit(closed) - 1;
+	x = to - 1;
+    }
+    return x;
+}
+
+// One seed per run of open pixels in [left, right] of row y
+void Flood_Fill::push_runs(const Canvas& canvas, int left, int right, int y, u32 target, std::vector<Fill_Seed>& stack) const {
+    if (right - left < SCAN_WINDOW) {
+	bool in_run = false;
+	for (int x = left; x <= right; x++) {
+	    bool open = is_open(canvas, x, y, target);
+	    if (open && !in_run) stack.push_back({x, y});
+	    in_run = open;
+	}
+	return;
+    }
+    for (int base = left & ~(TILE_SIZE - 1); base <= right; base += TILE_SIZE) {
+	u64 open = open_pixels(canvas, std::max(left, base), std::min(right + 1, base + TILE_SIZE), y, target);
+	while (open) {
+	    u64 low = open & (~open + 1);
+	    stack.push_back({base + lowest_bit(open), y});
+	    // Adding the lowest bit carries through the run and clears it
+	    open &= open + low;
+	}
+    }
+}
+
+u64 Flood_Fill::fill(Canvas& canvas, int x, int y, u32 color) {
+    min_x = canvas.width;
+    min_y = canvas.height;
+    max_x = -1;
+    max_y = -1;
+    if (!canvas.inside(x, y)) return 0;
+    if (parallel && (u64)canvas.width * canvas.height >= PARALLEL_FILL_PIXELS && job_pool().size() > 1) {
+	return fill_parallel(canvas, x, y, color, job_pool());
+    }
+    u32 target = canvas.get(x, y);
+    if (tolerance == 0 && target == color) return 0;
+    track_filled = color_matches(color, target, tolerance, metric);
+    if (track_filled) filled.resize((u64)canvas.tile_count() * TILE_SIZE, 0);
+
+    u64 count = 0;
+    stack.clear();
+    stack.push_back({x, y});
+    while (!stack.empty()) {
+	Fill_Seed seed = stack.back();
+	stack.pop_back();
+	// Already filled through another run of the same span
+	if (!is_open(canvas, seed.x, seed.y, target)) continue;
+	// Spans of a single pixel are common enough to skip the calls for
+	int left = seed.x;
+	int right = seed.x;
+	if (left > 0 && is_open(canvas, left - 1, seed.y, target)) left = scan_left(canvas, left - 1, seed.y, target);
+	if (right + 1 < canvas.width && is_open(canvas, right + 1, seed.y, target)) right = scan_right(canvas, right + 1, seed.y, target);
+	canvas.fill_span(seed.y, left, right + 1, color);
+	for (int b = left & ~(TILE_SIZE - 1); track_filled && b <= right; b += TILE_SIZE) {
+	    filled[canvas.index(b, seed.y) >> TILE_SHIFT] |= bit_range(std::max(left, b) - b, std::min(right, b + TILE_SIZE - 1) - b);
+	}
+	count += right - left + 1;
+
+	if (left < min_x) min_x = left;
+	if (right > max_x) max_x = right;
+	if (seed.y < min_y) min_y = seed.y;
+	if (seed.y > max_y) max_y = seed.y;
+	if (seed.y > 0) push_runs(canvas, left, right, seed.y - 1, target, stack);
+	if (seed.y < canvas.height - 1) push_runs(canvas, left, right, seed.y + 1, target, stack);
+    }
+    for (int row = min_y; track_filled && row <= max_y; row++) {
+	for (int b = min_x & ~(TILE_SIZE - 1); b <= max_x; b += TILE_SIZE) filled[canvas.index(b, row) >> TILE_SHIFT] = 0;
+    }
+    return count;
+}
+
+void Flood_Fill::fill_band(const Canvas& canvas, Fill_Band& band, int y0, int y1, u32 target) {
+    for (const Span& span : band.inbox) push_runs(canvas, span.x0, span.x1 - 1, span.y, target, band.stack);
+    band.inbox.clear();
+    while (!band.stack.empty()) {
+	Fill_Seed seed = band.stack.back();
+	band.stack.pop_back();
+	if (!is_open(canvas, seed.x, seed.y, target)) continue;
+	int left = seed.x;
+	int right = seed.x;
+	if (left > 0 && is_open(canvas, left - 1, seed.y, target)) left = scan_left(canvas, left - 1, seed.y, target);
+	if (right + 1 < canvas.width && is_open(canvas, right + 1, seed.y, target)) right = scan_right(canvas, right + 1, seed.y, target);
+	for (int b = left & ~(TILE_SIZE - 1); b <= right; b += TILE_SIZE) {
+	    filled[canvas.index(b, seed.y) >> TILE_SHIFT] |= bit_range(std::max(left, b) - b, std::min(right, b + TILE_SIZE - 1) - b);
+	    tiles_reached[canvas.tile_index(b, seed.y)] = 1;
+	}
+	band.count += right - left + 1;
+
+	if (left < band.min_x) band.min_x = left;
+	if (right > band.max_x) band.max_x = right;
+	if (seed.y < band.min_y) band.min_y = seed.y;
+	if (seed.y > band.max_y) band.max_y = seed.y;
+	// Rows of other bands are only searched by their own band
+	if (seed.y > y0) push_runs(canvas, left, right, seed.y - 1, target, band.stack);
+	else if (seed.y > 0) band.up.push_back({seed.y - 1, left, right + 1});
+	if (seed.y < y1 - 1) push_runs(canvas, left, right, seed.y + 1, target, band.stack);
+	else if (seed.y < canvas.height - 1) band.down.push_back({seed.y + 1, left, right + 1});
+    }
+}
+
+u64 Flood_Fill::fill_parallel(Canvas& canvas, int x, int y, u32 color, Job_Pool& pool) {
+    min_x = canvas.width;
+    min_y = canvas.height;
+    max_x = -1;
+    max_y = -1;
+    if (!canvas.inside(x, y)) return 0;
+    u32 target = canvas.get(x, y);
+    if (tolerance == 0 && target == color) return 0;
+    // Nothing is written while searching, filled pixels can only be told apart by their bit
+    track_filled = true;
+    filled.resize((u64)canvas.tile_count() * TILE_SIZE, 0);
+    tiles_reached.resize(canvas.tile_count(), 0);
+    bands.resize(canvas.tiles_y);
+    for (Fill_Band& band : bands) {
+	band.count = 0;
+	band.min_x = canvas.width;
+	band.min_y = canvas.height;
+	band.max_x = -1;
+	band.max_y = -1;
+    }
+    bands[y >> TILE_SHIFT].inbox.push_back({y, x, x + 1});
+    active_bands.assign(1, y >> TILE_SHIFT);
+    while (!active_bands.empty()) {
+	pool.parallel_for(active_bands.size(), [&](int i) {
+	    int band = active_bands[i];
+	    fill_band(canvas, bands[band], band << TILE_SHIFT, std::min((band + 1) << TILE_SHIFT, canvas.height), target);
+	});
+	for (int band = 0; band < (int)bands.size(); band++) {
+	    std::vector<Span>& up = bands[band].up;
+	    std::vector<Span>& down = bands[band].down;
+	    if (!up.empty()) bands[band - 1].inbox.insert(bands[band - 1].inbox.end(), up.begin(), up.end());
+	    if (!down.empty()) bands[band + 1].inbox.insert(bands[band + 1].inbox.end(), down.begin(), down.end());
+	    up.clear();
+	    down.clear();
+	}
+	active_bands.clear();
+	for (int band = 0; band < (int)bands.size(); band++) {
+	    if (!bands[band].inbox.empty()) active_bands.push_back(band);
+	}
+    }
+
+    u64 count = 0;
+    for (const Fill_Band& band : bands) {
+	count += band.count;
+	min_x = std::min(min_x, band.min_x);
+	min_y = std::min(min_y, band.min_y);
+	max_x = std::max(max_x, band.max_x);
+	max_y = std::max(max_y, band.max_y);
+    }
+    // Saving tiles for undo isn't thread safe, touch them here before any pixel changes
+    for (int tile = 0; tile < canvas.tile_count(); tile++) {
+	if (tiles_reached[tile]) canvas.touch(tile);
+    }
+    pool.parallel_for(bands.size(), [&](int band) {
+	int y0 = std::max(band << TILE_SHIFT, min_y);
+	int y1 = std::min(((band + 1) << TILE_SHIFT) - 1, max_y);
+	for (int row = y0; row <= y1; row++) {
+	    for (int b = min_x & ~(TILE_SIZE - 1); b <= max_x; b += TILE_SIZE) {
+		u64& word = filled[canvas.index(b, row) >> TILE_SHIFT];
+		u32* dst = canvas.pixels.data() + canvas.index(b, row);
+		while (word) {
+		    int start = lowest_bit(word);
+		    // Length of the run of set bits starting at start
+		    u64 rest = ~(word >> start);
+		    int run = rest ? lowest_bit(rest) : 64 - start;
+		    std::fill(dst + start, dst + start + run, color);
+		    word &= start + run < 64 ? ~0ull << (start + run) : 0;
+		}
+	    }
+	}
+	for (int tx = 0; tx < canvas.tiles_x; tx++) tiles_reached[band * canvas.tiles_x + tx] = 0;
+    });
+    return count;
+}
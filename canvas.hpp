@@ -0,0 +1,174 @@
+#pragma once
+#include "blend.hpp"
+#include "common.hpp"
+#include "jobs.hpp"
+#include <cstring>
+#include <vector>
+
+// Pixels are stored as RGBA8, the same byte order as raylib's Color.
+inline u32 color_to_pixel(Color color) {
+    u32 pixel;
+    memcpy(&pixel, &color, sizeof(pixel));
+    return pixel;
+}
+
+inline Color pixel_to_color(u32 pixel) {
+    Color color;
+    memcpy(&color, &pixel, sizeof(color));
+    return color;
+}
+
+// Index of the lowest and highest set bit, x must not be 0
+#ifdef _MSC_VER
+#include <intrin.h>
+inline int lowest_bit(u64 x) {
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return index;
+}
+inline int highest_bit(u64 x) {
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return index;
+}
+#else
+inline int lowest_bit(u64 x) {
+    return __builtin_ctzll(x);
+}
+inline int highest_bit(u64 x) {
+    return 63 - __builtin_clzll(x);
+}
+#endif
+
+// Pixels [x0, x1) of row y
+struct Span {
+    int y;
+    int x0;
+    int x1;
+};
+
+const int TILE_SHIFT = 6;
+const int TILE_SIZE = 1 << TILE_SHIFT;
+const int TILE_PIXELS = TILE_SIZE * TILE_SIZE;
+
+// RGBA8 image stored as TILE_SIZE x TILE_SIZE tiles, each tile contiguous and row-major,
+// tiles laid out row-major. Tiles on the right and bottom edge are padded.
+// Every write goes through touch(), which flags the tile dirty for the texture upload and
+// stamps it with the current generation so other consumers (undo, autosave) can find the
+// tiles that changed since their last checkpoint().
+// Between begin_edit() and end_edit() the first write to a tile saves its previous content.
+struct Canvas {
+    int width = 0;
+    int height = 0;
+    int tiles_x = 0;
+    int tiles_y = 0;
+    u64 generation = 1;
+    std::vector<u32> pixels;
+    std::vector<u8> dirty;
+    std::vector<u64> tile_generation;
+    bool editing = false;
+    u64 edit_checkpoint = 0;
+    std::vector<int> edit_tiles;
+    // TILE_PIXELS per entry of edit_tiles
+    std::vector<u32> edit_backup;
+    void init(int width, int height, u32 color);
+    int tile_count() const { return tiles_x * tiles_y; }
+    int tile_index(int x, int y) const { return (y >> TILE_SHIFT) * tiles_x + (x >> TILE_SHIFT); }
+    u64 index(int x, int y) const {
+	return ((u64)tile_index(x, y) << (2 * TILE_SHIFT)) + ((y & (TILE_SIZE - 1)) << TILE_SHIFT) + (x & (TILE_SIZE - 1));
+    }
+    bool inside(int x, int y) const { return x >= 0 && y >= 0 && x < width && y < height; }
+    u32* tile(int tile) { return pixels.data() + ((u64)tile << (2 * TILE_SHIFT)); }
+    const u32* tile(int tile) const { return pixels.data() + ((u64)tile << (2 * TILE_SHIFT)); }
+    u32 get(int x, int y) const { return pixels[index(x, y)]; }
+    void touch(int tile) {
+	if (editing && tile_generation[tile] <= edit_checkpoint) backup_tile(tile);
+	dirty[tile] = 1;
+	tile_generation[tile] = generation;
+    }
+    // Returns the generation that is now closed, tiles written afterwards compare greater
+    u64 checkpoint() { return generation++; }
+    bool changed_since(int tile, u64 checkpoint) const { return tile_generation[tile] > checkpoint; }
+    void backup_tile(int tile);
+    void begin_edit();
+    void end_edit();
+    void set(int x, int y, u32 color);
+    // Writes [x0, x1) of row y, clipped to the canvas
+    void fill_span(int y, int x0, int x1, u32 color);
+    void fill_spans(const std::vector<Span>& spans, u32 color);
+    // Paints spans with per pixel coverage, coverage holds the pixels of all spans in order
+    void paint_spans(const std::vector<Span>& spans, const std::vector<u8>& coverage, u32 color, Brush_Mode mode);
+    void copy_to_linear(u32* dst) const;
+    void copy_from_linear(const u32* src);
+};
+
+struct Fill_Seed {
+    int x;
+    int y;
+};
+
+// Part of a parallel fill: the rows of one tile row of the canvas, the spans that reached it
+// from its neighbours and the spans it reached in the rows just above and below it
+struct Fill_Band {
+    std::vector<Fill_Seed> stack;
+    std::vector<Span> inbox;
+    std::vector<Span> up;
+    std::vector<Span> down;
+    u64 count = 0;
+    int min_x = 0;
+    int min_y = 0;
+    int max_x = -1;
+    int max_y = -1;
+};
+
+// Canvases with fewer pixels are filled serially, waking the pool costs more than it saves
+const u64 PARALLEL_FILL_PIXELS = 1 << 20;
+
+// Scanline flood fill over a canvas. The seed stack is kept between calls
+// so repeated fills don't allocate.
+// Long runs are matched a tile row at a time with match_span, so each row of up to TILE_SIZE
+// pixels becomes one bit mask and the run ends are found with bit scans.
+// When the fill color is itself within tolerance of the target, filled pixels would match
+// again, so they are also marked in a bit map with one word per tile row and excluded.
+struct Flood_Fill {
+    std::vector<Fill_Seed> stack;
+    // tile_count * TILE_SIZE words, indexed like Canvas::index >> TILE_SHIFT. All zero between
+    // fills, only the words inside the bounding box are cleared after each fill.
+    std::vector<u64> filled;
+    bool track_filled = false;
+    int tolerance = 0;
+    Color_Metric metric = METRIC_CHANNEL;
+    // Bounding box of the last fill, inclusive
+    int min_x = 0;
+    int min_y = 0;
+    int max_x = -1;
+    int max_y = -1;
+    // Fill large canvases with fill_parallel()
+    bool parallel = true;
+    std::vector<Fill_Band> bands;
+    std::vector<int> active_bands;
+    // Tiles holding filled bits, one flag per tile
+    std::vector<u8> tiles_reached;
+    // Returns the number of pixels written
+    u64 fill(Canvas& canvas, int x, int y, u32 color);
+    // Fills the same pixels as the serial fill, a band of tiles per pool thread. Only the filled
+    // bit map is written while searching, so bands can read each other's rows but only mark
+    // their own. Spans that reach the row next to a band are handed to that band and searched
+    // in the next round, until no band has any left. The pixels are written at the end.
+    u64 fill_parallel(Canvas& canvas, int x, int y, u32 color, Job_Pool& pool);
+    void fill_band(const Canvas& canvas, Fill_Band& band, int y0, int y1, u32 target);
+    // Pixels of [x0, x1) that match target and aren't filled yet, bit i is the pixel in column i
+    // of the tile. The range must lie within one tile row.
+    u64 open_pixels(const Canvas& canvas, int x0, int x1, int y, u32 target) const;
+    bool is_open(const Canvas& canvas, int x, int y, u32 target) const {
+	u64 index = canvas.index(x, y);
+	u32 pixel = canvas.pixels[index];
+	// Exact fills are the common case, keep them to one compare
+	if (pixel != target && (tolerance == 0 || !color_matches(pixel, target, tolerance, metric))) return false;
+	return !track_filled || !(filled[index >> TILE_SHIFT] >> (x & (TILE_SIZE - 1)) & 1);
+    }
+    // Last open pixel of the run starting at the open pixel (x, y), going left or right
+    int scan_left(const Canvas& canvas, int x, int y, u32 target) const;
+    int scan_right(const Canvas& canvas, int x, int y, u32 target) const;
+    void push_runs(const Canvas& canvas, int left, int right, int y, u32 target, std::vector<Fill_Seed>& stack) const;
+};
@@ -8,6 +8,18 @@ const char* mode_as_string(Draw_Mode mode) {
 	return "Line Start";
     case FILL:
 	return "Fill";
+    case REPLACE:
+	return "Replace";
+    case RECT:
+	return "Rect";
+    case FILLED_RECT:
+	return "Filled Rect";
+    case ELLIPSE:
+	return "Ellipse";
+    case FILLED_ELLIPSE:
+	return "Filled Ellipse";
+    case POLYGON:
+	return "Polygon";
     case MOUSE_MODE_MAX:
 	assert(0);
     }
@@ -15,6 +27,10 @@ const char* mode_as_string(Draw_Mode mode) {
     return "";
 }
 
+bool is_drag_mode(Draw_Mode mode) {
+    return mode == LINE || mode == RECT || mode == FILLED_RECT || mode == ELLIPSE || mode == FILLED_ELLIPSE || mode == POLYGON;
+}
+
 Rectangle squish_rec(Rectangle rec, float padding) {
     return {rec.x + padding, rec.y + padding, rec.width - padding * 2.f, rec.height - padding * 2.f};
 }
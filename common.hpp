@@ -1,3 +1,4 @@
+#pragma once
 #include "includes/raylib.h"
 #include <stdint.h>
 #include <cassert>
@@ -7,7 +8,7 @@ typedef uint32_t u32;
 typedef uint8_t u8;
 
 enum Draw_Mode {
-    DRAW, LINE, FILL, MOUSE_MODE_MAX
+    DRAW, LINE, FILL, REPLACE, RECT, FILLED_RECT, ELLIPSE, FILLED_ELLIPSE, POLYGON, MOUSE_MODE_MAX
 };
 
 enum Layout_Type {
@@ -15,6 +16,8 @@ enum Layout_Type {
 };
 
 const char* mode_as_string(Draw_Mode mode);
+// Tools that are dragged from the press to the release, with a preview of the result
+bool is_drag_mode(Draw_Mode mode);
 Rectangle squish_rec(Rectangle rec, float padding);
 Rectangle rec_slice_vert(Rectangle rec, u64 slot, u64 max_slots);
 Rectangle rec_slice_horz(Rectangle rec, u64 slot, u64 max_slots);
@@ -0,0 +1,455 @@
+#include "editor.hpp"
+#include <algorithm>
+#include <cstdio>
+
+void Editor::init(int width, int height, u32 color) {
+    layers.clear();
+    layers.emplace_back();
+    layers[0].canvas.init(width, height, color);
+    active = 0;
+    composite.init(width, height, 0);
+    below.init(width, height, 0);
+    above.init(width, height, 0);
+    invalidate_cache();
+    history.clear();
+    // Generations start over with the canvas, the labels' checkpoints mean nothing now
+    labels.clear();
+    brush.build();
+    mirror.width = width;
+    mirror.height = height;
+}
+
+bool Editor::add_layer() {
+    if (stroking || (int)layers.size() >= MAX_LAYERS) return false;
+    layers.emplace_back();
+    layers.back().canvas.init(composite.width, composite.height, 0);
+    active = layers.size() - 1;
+    invalidate_cache();
+    journal.add(JOURNAL_ADD_LAYER);
+    return true;
+}
+
+void Editor::select_layer(int index) {
+    if (stroking || index < 0 || index >= (int)layers.size() || index == active) return;
+    active = index;
+    invalidate_cache();
+    journal.add(JOURNAL_SELECT_LAYER, Journal_Value{index});
+}
+
+void Editor::set_visible(bool visible) {
+    active_layer().visible = visible;
+    layers_changed = true;
+    journal.add(JOURNAL_SET_VISIBLE, Journal_Value{visible});
+}
+
+void Editor::set_opacity(u8 opacity) {
+    active_layer().opacity = opacity;
+    layers_changed = true;
+    journal.add(JOURNAL_SET_OPACITY, Journal_Value{opacity});
+}
+
+void Editor::set_blend(Blend_Mode blend) {
+    active_layer().blend = blend;
+    layers_changed = true;
+    journal.add(JOURNAL_SET_BLEND, Journal_Value{blend});
+}
+
+void Editor::invalidate_cache() {
+    std::fill(cache_valid.begin(), cache_valid.end(), 0);
+    cache_valid.resize(composite.tile_count(), 0);
+    above_flattened = true;
+    for (int i = active + 1; i < (int)layers.size(); i++) {
+	const Layer& layer = layers[i];
+	if (layer.visible && layer.opacity > 0 && layer.blend != BLEND_NORMAL) above_flattened = false;
+    }
+    layers_changed = true;
+}
+
+void Editor::update_composite() {
+    flush_stroke();
+    for (int tile = 0; tile < composite.tile_count(); tile++) {
+	bool dirty = layers_changed;
+	for (int i = 0; i < (int)layers.size(); i++) {
+	    if (!layers[i].canvas.dirty[tile]) continue;
+	    dirty = true;
+	    if (i != active) cache_valid[tile] = 0;
+	}
+	if (!dirty) continue;
+	composite_tile(tile);
+	for (Layer& layer : layers) layer.canvas.dirty[tile] = 0;
+    }
+    layers_changed = false;
+}
+
+void Editor::build_cache(int tile) {
+    u32* dst = below.tile(tile);
+    std::fill(dst, dst + TILE_PIXELS, 0);
+    for (int i = 0; i < active; i++) {
+	const Layer& layer = layers[i];
+	if (!layer.visible || layer.opacity == 0) continue;
+	blend_span(dst, layer.canvas.tile(tile), TILE_PIXELS, layer.opacity, layer.blend);
+    }
+    if (above_flattened) {
+	dst = above.tile(tile);
+	std::fill(dst, dst + TILE_PIXELS, 0);
+	for (int i = active + 1; i < (int)layers.size(); i++) {
+	    const Layer& layer = layers[i];
+	    if (!layer.visible || layer.opacity == 0) continue;
+	    blend_span(dst, layer.canvas.tile(tile), TILE_PIXELS, layer.opacity, layer.blend);
+	}
+    }
+    cache_valid[tile] = 1;
+}
+
+void Editor::composite_tile(int tile) {
+    if (!cache_valid[tile]) build_cache(tile);
+    composite.touch(tile);
+    u32* dst = composite.tile(tile);
+    memcpy(dst, below.tile(tile), TILE_PIXELS * sizeof(u32));
+    const Layer& layer = active_layer();
+    if (layer.visible && layer.opacity > 0) blend_span(dst, layer.canvas.tile(tile), TILE_PIXELS, layer.opacity, layer.blend);
+    if (above_flattened) {
+	over_span(dst, above.tile(tile), TILE_PIXELS);
+	return;
+    }
+    for (int i = active + 1; i < (int)layers.size(); i++) {
+	const Layer& above_layer = layers[i];
+	if (!above_layer.visible || above_layer.opacity == 0) continue;
+	blend_span(dst, above_layer.canvas.tile(tile), TILE_PIXELS, above_layer.opacity, above_layer.blend);
+    }
+}
+
+void Editor::set_pixel(int x, int y, u32 color) {
+    if (!canvas().inside(x, y)) return;
+    history.begin(canvas(), active);
+    for (int i = 0; i < mirror.image_count(); i++) {
+	Point image = mirror.transform(mirror.image(i), x, y);
+	if (canvas().inside(image.x, image.y)) canvas().set(image.x, image.y, color);
+    }
+    bool pushed = history.commit(canvas());
+    journal.add(JOURNAL_SET_PIXEL, Journal_Pixel{x, y, color, (u8)mirror.symmetry, pushed});
+}
+
+void Editor::begin_stroke(int x, int y, u32 color) {
+    if (stroking) end_stroke();
+    stroking = true;
+    stroke_layer = active;
+    stroke_x = x;
+    stroke_y = y;
+    stroke_color = color;
+    stroke_phase = 0;
+    stroke_brush = brush;
+    stroke_mirror.symmetry = mirror.symmetry;
+    stroke_mirror.width = mirror.width;
+    stroke_mirror.height = mirror.height;
+    history.begin(canvas(), active);
+    stroke_points.clear();
+    stroke_points.push_back({x, y});
+    if (!journal.is_open()) return;
+    if (brush.shape == BRUSH_CUSTOM && journal.stamp != brush.custom) {
+	journal.stamp = brush.custom;
+	journal.add(JOURNAL_BRUSH_STAMP, Journal_Stamp{brush.custom_size});
+	journal.add_bytes(brush.custom.data(), brush.custom.size());
+    }
+    journal.add(JOURNAL_BEGIN_STROKE, Journal_Stroke{x, y, color, brush.size, brush.hardness, (u8)brush.shape, (u8)brush.mode, (u8)mirror.symmetry});
+}
+
+void Editor::stroke_to(int x, int y) {
+    if (!stroking || (x == stroke_x && y == stroke_y)) return;
+    line_points(stroke_x, stroke_y, x, y, stroke_brush.spacing(), stroke_phase, stroke_points);
+    stroke_x = x;
+    stroke_y = y;
+    journal.add(JOURNAL_STROKE_TO, Journal_Point{x, y});
+}
+
+void Editor::flush_stroke() {
+    if (stroke_points.empty()) return;
+    Canvas& target = layers[stroke_layer].canvas;
+    int size = stroke_brush.size;
+    for (const Point& point : stroke_points) {
+	for (int i = 0; i < stroke_mirror.image_count(); i++) {
+	    // Mirror the stamp's box, the center of an even size isn't on a pixel
+	    Point corner = stroke_mirror.transform(stroke_mirror.image(i), point.x - size / 2, point.y - size / 2, size, size);
+	    stroke_brush.stamp(target, corner.x + size / 2, corner.y + size / 2, stroke_color);
+	}
+    }
+    stroke_points.clear();
+}
+
+void Editor::end_stroke() {
+    if (!stroking) return;
+    flush_stroke();
+    bool pushed = history.commit(layers[stroke_layer].canvas);
+    stroking = false;
+    journal.add(JOURNAL_END_STROKE, Journal_End{pushed});
+}
+
+void Editor::draw_line(int x0, int y0, int x1, int y1, u32 color) {
+    Canvas& canvas = this->canvas();
+    spans.clear();
+    history.begin(canvas, active);
+    if (line_aa && line_width == 1) {
+	// Mirrored coverage would have to follow the spans around, the mirrored ends are simpler
+	line_coverage.clear();
+	for (int i = 0; i < mirror.image_count(); i++) {
+	    Point a = mirror.transform(mirror.image(i), x0, y0);
+	    Point b = mirror.transform(mirror.image(i), x1, y1);
+	    rasterize_line_aa(a.x, a.y, b.x, b.y, canvas.width, canvas.height, spans, line_coverage);
+	}
+	canvas.paint_spans(spans, line_coverage, color, BRUSH_NORMAL);
+    }
+    else {
+	rasterize_thick_line(x0, y0, x1, y1, line_width, canvas.width, canvas.height, spans);
+	mirror.mirror_spans(spans);
+	canvas.fill_spans(spans, color);
+    }
+    bool pushed = history.commit(canvas);
+    journal.add(JOURNAL_LINE, Journal_Line{x0, y0, x1, y1, color, (u8)line_width, line_aa, (u8)mirror.symmetry, pushed});
+}
+
+void Editor::draw_spans(const std::vector<Span>& spans, u32 color) {
+    this->spans.assign(spans.begin(), spans.end());
+    mirror.mirror_spans(this->spans);
+    history.begin(canvas(), active);
+    canvas().fill_spans(this->spans, color);
+    bool pushed = history.commit(canvas());
+    if (!journal.is_open()) return;
+    journal.add(JOURNAL_SPANS, Journal_Spans{(u32)spans.size(), color, (u8)mirror.symmetry, pushed});
+    journal.add_bytes(spans.data(), spans.size() * sizeof(Span));
+}
+
+void Editor::fill(int x, int y, u32 color) {
+    if (!canvas().inside(x, y)) return;
+    history.begin(canvas(), active);
+    // A mirrored seed may land in a region an earlier image already filled, that fill is empty
+    for (int i = 0; i < mirror.image_count(); i++) {
+	Point seed = mirror.transform(mirror.image(i), x, y);
+	if (!canvas().inside(seed.x, seed.y)) continue;
+	const Region* region = fill_region(seed.x, seed.y);
+	if (region && region->color == color) continue;
+	if (region) {
+	    for (u32 r = region->first; r < region->first + region->run_count; r++) {
+		const Span& run = labels.labels.runs[r];
+		canvas().fill_span(run.y, run.x0, run.x1, color);
+	    }
+	}
+	else flood_fill.fill(canvas(), seed.x, seed.y, color);
+    }
+    bool pushed = history.commit(canvas());
+    journal.add(JOURNAL_FILL, Journal_Fill{x, y, color, flood_fill.tolerance, (u8)flood_fill.metric, (u8)mirror.symmetry, pushed});
+}
+
+bool Editor::update_labels() {
+    bool installed = labels.poll();
+    if (!labels.busy() && !stroking && !canvas().editing && labels.stale(canvas(), active)) labels.start(canvas(), active);
+    return installed;
+}
+
+const Region* Editor::fill_region(int x, int y) {
+    // A tolerance fill crosses color boundaries, the labels only know exact regions
+    if (flood_fill.tolerance > 0) return nullptr;
+    return labels.lookup(canvas(), active, x, y);
+}
+
+u64 Editor::replace_color(u32 from, u32 to) {
+    if (stroking || from == to) return 0;
+    Canvas& canvas = this->canvas();
+    replace_runs.resize(canvas.tile_count());
+    job_pool().parallel_for(canvas.tile_count(), [&](int tile) {
+	std::vector<Delta_Run>& runs = replace_runs[tile];
+	runs.clear();
+	// Edge tiles are padded, leave the padding alone
+	int width = std::min(TILE_SIZE, canvas.width - (tile % canvas.tiles_x) * TILE_SIZE);
+	int height = std::min(TILE_SIZE, canvas.height - (tile / canvas.tiles_x) * TILE_SIZE);
+	u32 base = (u32)tile << (2 * TILE_SHIFT);
+	u32* pixels = canvas.tile(tile);
+	for (int row = 0; row < height; row++) {
+	    u32* src = pixels + row * TILE_SIZE;
+	    u64 matches = match_span(src, width, from, 0, METRIC_CHANNEL);
+	    while (matches) {
+		int start = lowest_bit(matches);
+		// Length of the run of set bits starting at start
+		u64 rest = ~(matches >> start);
+		int count = rest ? lowest_bit(rest) : 64 - start;
+		std::fill(src + start, src + start + count, to);
+		u32 index = base + row * TILE_SIZE + start;
+		if (!runs.empty() && runs.back().index + runs.back().count == index) runs.back().count += count;
+		else runs.push_back({index, (u32)count});
+		matches &= count + start < 64 ? ~0ull << (start + count) : 0;
+	    }
+	}
+	if (!runs.empty()) canvas.touch(tile);
+    });
+    Undo_Entry entry;
+    entry.layer = active;
+    entry.uniform = true;
+    entry.before_color = from;
+    entry.after_color = to;
+    u64 replaced = 0;
+    for (const std::vector<Delta_Run>& runs : replace_runs) {
+	entry.runs.insert(entry.runs.end(), runs.begin(), runs.end());
+	for (const Delta_Run& run : runs) replaced += run.count;
+    }
+    if (replaced > 0) history.push(std::move(entry));
+    journal.add(JOURNAL_REPLACE_COLOR, Journal_Replace{from, to, replaced > 0});
+    return replaced;
+}
+
+bool Editor::undo() {
+    if (stroking || !history.can_undo()) return false;
+    if (!history.undo(layers[history.undo_layer()].canvas)) return false;
+    journal.add(JOURNAL_UNDO);
+    return true;
+}
+
+bool Editor::redo() {
+    if (stroking || !history.can_redo()) return false;
+    if (!history.redo(layers[history.redo_layer()].canvas)) return false;
+    journal.add(JOURNAL_REDO);
+    return true;
+}
+
+bool Editor::select_branch(int step) {
+    if (stroking || !history.select_branch(step)) return false;
+    journal.add(JOURNAL_SELECT_BRANCH, Journal_Branch{history.redo_target()});
+    return true;
+}
+
+void Editor::journal_save(const char* path) {
+    if (!journal.is_open()) return;
+    const Layer& layer = layers[0];
+    Journal_Save save = {++journal.save_id, 0, {0}};
+    // The composite of one such layer is the layer itself, as long as every pixel is opaque.
+    // That is only known once the save has the pixels, see journal_saved().
+    save.exact = layers.size() == 1 && layer.visible && layer.opacity == 255 && layer.blend == BLEND_NORMAL && !stroking;
+    snprintf(save.path, sizeof(save.path), "%s", path);
+    journal.add(JOURNAL_SAVE_BEGIN, save);
+    // A recovery from this save won't see the stamps journaled before it
+    journal.stamp.clear();
+}
+
+void Editor::journal_saved(u64 hash, bool opaque) {
+    journal.add(JOURNAL_SAVE_DONE, Journal_Saved{hash, journal.save_id, opaque});
+}
+
+u64 Editor::replay(const std::vector<u8>& records, const Journal_Plan& plan, const u32* saved) {
+    init(plan.init.width, plan.init.height, plan.init.color);
+    if (saved) canvas().copy_from_linear(saved);
+    history.serial = plan.first_serial;
+    Journal_Reader reader = {records.data(), records.size(), plan.start};
+    u64 edit = plan.first_edit;
+    u64 replayed = 0;
+    // Edits nothing undoes later are replayed without undo entries. They still take the
+    // serials of the entries they made, which select branch records refer to, and undo
+    // stops at them.
+    auto begin_edit = [&]() { history.paused = !plan.keep[edit++]; };
+    auto end_edit = [&](bool pushed) {
+	if (history.paused && pushed) history.skip();
+    };
+    while (reader.next()) {
+	replayed++;
+	switch (reader.op) {
+	case JOURNAL_INIT:
+	    break;
+	case JOURNAL_ADD_LAYER:
+	    add_layer();
+	    break;
+	case JOURNAL_SELECT_LAYER:
+	    select_layer(reader.get<Journal_Value>().value);
+	    break;
+	case JOURNAL_SET_VISIBLE:
+	    set_visible(reader.get<Journal_Value>().value);
+	    break;
+	case JOURNAL_SET_OPACITY:
+	    set_opacity(reader.get<Journal_Value>().value);
+	    break;
+	case JOURNAL_SET_BLEND:
+	    set_blend((Blend_Mode)(reader.get<Journal_Value>().value % BLEND_MODE_MAX));
+	    break;
+	case JOURNAL_SET_PIXEL: {
+	    Journal_Pixel pixel = reader.get<Journal_Pixel>();
+	    mirror.symmetry = (Symmetry)(pixel.symmetry % SYMMETRY_MAX);
+	    begin_edit();
+	    set_pixel(pixel.x, pixel.y, pixel.color);
+	    end_edit(pixel.pushed);
+	    break;
+	}
+	case JOURNAL_BRUSH_STAMP:
+	    brush.set_custom(reader.array, reader.get<Journal_Stamp>().size);
+	    break;
+	case JOURNAL_BEGIN_STROKE: {
+	    Journal_Stroke stroke = reader.get<Journal_Stroke>();
+	    brush.mode = (Brush_Mode)(stroke.mode % BRUSH_MODE_MAX);
+	    brush.set_shape((Brush_Shape)(stroke.shape % BRUSH_SHAPE_MAX));
+	    brush.set_size(stroke.size);
+	    brush.set_hardness(stroke.hardness);
+	    mirror.symmetry = (Symmetry)(stroke.symmetry % SYMMETRY_MAX);
+	    begin_edit();
+	    begin_stroke(stroke.x, stroke.y, stroke.color);
+	    break;
+	}
+	case JOURNAL_STROKE_TO: {
+	    Journal_Point point = reader.get<Journal_Point>();
+	    stroke_to(point.x, point.y);
+	    break;
+	}
+	case JOURNAL_END_STROKE:
+	    end_stroke();
+	    end_edit(reader.get<Journal_End>().pushed);
+	    break;
+	case JOURNAL_LINE: {
+	    Journal_Line line = reader.get<Journal_Line>();
+	    line_width = line.width;
+	    line_aa = line.aa;
+	    mirror.symmetry = (Symmetry)(line.symmetry % SYMMETRY_MAX);
+	    begin_edit();
+	    draw_line(line.x0, line.y0, line.x1, line.y1, line.color);
+	    end_edit(line.pushed);
+	    break;
+	}
+	case JOURNAL_SPANS: {
+	    Journal_Spans header = reader.get<Journal_Spans>();
+	    std::vector<Span> spans(header.count);
+	    memcpy(spans.data(), reader.array, spans.size() * sizeof(Span));
+	    mirror.symmetry = (Symmetry)(header.symmetry % SYMMETRY_MAX);
+	    begin_edit();
+	    draw_spans(spans, header.color);
+	    end_edit(header.pushed);
+	    break;
+	}
+	case JOURNAL_FILL: {
+	    Journal_Fill fill = reader.get<Journal_Fill>();
+	    flood_fill.tolerance = fill.tolerance;
+	    flood_fill.metric = (Color_Metric)(fill.metric % METRIC_MAX);
+	    mirror.symmetry = (Symmetry)(fill.symmetry % SYMMETRY_MAX);
+	    begin_edit();
+	    this->fill(fill.x, fill.y, fill.color);
+	    end_edit(fill.pushed);
+	    break;
+	}
+	case JOURNAL_REPLACE_COLOR: {
+	    Journal_Replace replace = reader.get<Journal_Replace>();
+	    begin_edit();
+	    replace_color(replace.from, replace.to);
+	    end_edit(replace.pushed);
+	    break;
+	}
+	case JOURNAL_UNDO:
+	    undo();
+	    break;
+	case JOURNAL_REDO:
+	    redo();
+	    break;
+	case JOURNAL_SELECT_BRANCH:
+	    history.select_redo(reader.get<Journal_Branch>().serial);
+	    break;
+	case JOURNAL_SAVE_BEGIN:
+	case JOURNAL_SAVE_DONE:
+	    break;
+	case JOURNAL_OP_MAX:
+	    assert(0);
+	}
+    }
+    history.paused = false;
+    return replayed;
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include "blend.hpp"
+#include "brush.hpp"
+#include "canvas.hpp"
+#include "history.hpp"
+#include "jobs.hpp"
+#include "journal.hpp"
+#include "labels.hpp"
+#include "raster.hpp"
+#include "symmetry.hpp"
+
+const int MAX_LAYERS = 64;
+
+// Straight alpha pixels, composited onto the layers below with opacity and blend mode
+struct Layer {
+    Canvas canvas;
+    u8 opacity = 255;
+    bool visible = true;
+    Blend_Mode blend = BLEND_NORMAL;
+};
+
+// The sprite and every tool that edits it, without any window or GPU dependency.
+// Tools draw into the active layer and each tool call is one undo step.
+// New layers always go on top, so the layer index in undo entries stays valid.
+struct Editor {
+    std::vector<Layer> layers;
+    int active = 0;
+    // Premultiplied result of all visible layers. A layer tile that is dirty needs compositing,
+    // a composite tile that is dirty needs uploading.
+    Canvas composite;
+    bool layers_changed = false;
+    // Layers below and above the active one flattened per tile, so compositing a tile of the
+    // active layer blends three buffers however deep the stack is. A tile's cache is rebuilt
+    // when a non-active layer changes there, all of it when the active layer changes.
+    // Only normal layers can be flattened above, otherwise they are blended one by one.
+    Canvas below;
+    Canvas above;
+    std::vector<u8> cache_valid;
+    bool above_flattened = true;
+    History history;
+    // Every call below that changes the sprite is journaled once it's done, while the journal is open
+    Journal journal;
+    Flood_Fill flood_fill;
+    // Exact fills are looked up here when the region under the click is still current
+    Label_Cache labels;
+    std::vector<Span> spans;
+    // Lines of draw_line(), anti-aliasing applies to lines 1 pixel wide only
+    int line_width = 1;
+    bool line_aa = false;
+    std::vector<u8> line_coverage;
+    // Every tool paints the images of its pixels under mirror.symmetry in the same undo step:
+    // span tools mirror their spans, strokes their stamps, fills their seed, set_pixel its pixel.
+    Mirror mirror;
+    Brush brush;
+    // Freehand stroke, one undo step from begin_stroke() to end_stroke(). The brush positions
+    // along the segments between samples collect in stroke_points and are stamped in
+    // flush_stroke(), so a frame's samples become a single write. The stroke keeps the brush and
+    // symmetry it began with, changes to them apply from the next stroke on.
+    bool stroking = false;
+    Brush stroke_brush;
+    Mirror stroke_mirror;
+    int stroke_layer = 0;
+    int stroke_x = 0;
+    int stroke_y = 0;
+    // Pixels walked since the last stamp
+    int stroke_phase = 0;
+    u32 stroke_color = 0;
+    std::vector<Point> stroke_points;
+    // Runs replace_color() found in each tile, kept so repeated calls don't allocate
+    std::vector<std::vector<Delta_Run>> replace_runs;
+    void init(int width, int height, u32 color);
+    Canvas& canvas() { return layers[active].canvas; }
+    Layer& active_layer() { return layers[active]; }
+    // Returns false when there are already MAX_LAYERS
+    bool add_layer();
+    void select_layer(int index);
+    void set_visible(bool visible);
+    void set_opacity(u8 opacity);
+    void set_blend(Blend_Mode blend);
+    // Composites every tile that changed in any layer since the last call
+    void update_composite();
+    void composite_tile(int tile);
+    void invalidate_cache();
+    void build_cache(int tile);
+    void set_pixel(int x, int y, u32 color);
+    void begin_stroke(int x, int y, u32 color);
+    void stroke_to(int x, int y);
+    void flush_stroke();
+    void end_stroke();
+    void draw_line(int x0, int y0, int x1, int y1, u32 color);
+    // Writes spans rasterized elsewhere, e.g. for a shape preview, as one undo step
+    void draw_spans(const std::vector<Span>& spans, u32 color);
+    void fill(int x, int y, u32 color);
+    // Installs finished labels and starts a build when the active layer changed since the last
+    // one. Returns true when new labels were installed.
+    bool update_labels();
+    // Region of an exact fill at (x, y) if the labels have it, else nullptr
+    const Region* fill_region(int x, int y);
+    // Every pixel of color from in the active layer becomes to, as one undo step.
+    // Tiles are scanned in parallel. Returns the number of pixels replaced.
+    u64 replace_color(u32 from, u32 to);
+    bool undo();
+    bool redo();
+    // Redo follows the last branch made or visited, this makes it take the branch step
+    // branches further along. An edit after an undo starts a new branch.
+    bool select_branch(int step);
+    // A save of the composite to path started, exact when the saved image holds all there is
+    void journal_save(const char* path);
+    // The save finished, the pixels written have this hash
+    void journal_saved(u64 hash, bool opaque);
+    // Rebuilds the sprite from the journal's records as plan says, starting from saved, the
+    // row-major pixels of the save, when the plan starts at one. Returns the records replayed.
+    u64 replay(const std::vector<u8>& records, const Journal_Plan& plan, const u32* saved);
+};
@@ -0,0 +1,376 @@
+#include "history.hpp"
+#include <algorithm>
+
+u64 Undo_Entry::bytes() const {
+    return sizeof(Undo_Entry) + runs.size() * sizeof(Delta_Run) + (before.size() + after.size()) * sizeof(u32);
+}
+
+static void put_varint(std::vector<u8>& out, u64 value) {
+    while (value >= 0x80) {
+	out.push_back((u8)value | 0x80);
+	value >>= 7;
+    }
+    out.push_back((u8)value);
+}
+
+static u64 get_varint(const u8*& src) {
+    u64 value = 0;
+    for (int shift = 0;; shift += 7) {
+	u8 byte = *src++;
+	value |= (u64)(byte & 0x7F) << shift;
+	if (!(byte & 0x80)) return value;
+    }
+}
+
+// Runs of at least this many equal pixels are stored as one value, shorter ones as literals
+const int MIN_REPEAT = 3;
+
+// Tokens: varint(count << 1 | 1) then one pixel for count repeats,
+// varint(count << 1) then count literal pixels
+static void compress_pixels(const std::vector<u32>& pixels, std::vector<u8>& out) {
+    size_t i = 0;
+    size_t literal = 0;
+    auto flush_literals = [&](size_t end) {
+	if (literal == end) return;
+	put_varint(out, (u64)(end - literal) << 1);
+	size_t at = out.size();
+	out.resize(at + (end - literal) * sizeof(u32));
+	memcpy(out.data() + at, pixels.data() + literal, (end - literal) * sizeof(u32));
+    };
+    while (i < pixels.size()) {
+	size_t run = 1;
+	while (i + run < pixels.size() && pixels[i + run] == pixels[i]) run++;
+	if (run < MIN_REPEAT) {
+	    i += run;
+	    continue;
+	}
+	flush_literals(i);
+	put_varint(out, (u64)run << 1 | 1);
+	size_t at = out.size();
+	out.resize(at + sizeof(u32));
+	memcpy(out.data() + at, &pixels[i], sizeof(u32));
+	i += run;
+	literal = i;
+    }
+    flush_literals(pixels.size());
+}
+
+static const u8* decompress_pixels(const u8* src, u32* dst, u64 count) {
+    u32* end = dst + count;
+    while (dst < end) {
+	u64 token = get_varint(src);
+	u64 n = token >> 1;
+	if (token & 1) {
+	    u32 pixel;
+	    memcpy(&pixel, src, sizeof(u32));
+	    src += sizeof(u32);
+	    std::fill(dst, dst + n, pixel);
+	}
+	else {
+	    memcpy(dst, src, n * sizeof(u32));
+	    src += n * sizeof(u32);
+	}
+	dst += n;
+    }
+    return src;
+}
+
+void compress_entry(const Undo_Entry& entry, std::vector<u8>& out) {
+    put_varint(out, entry.runs.size());
+    u32 end = 0;
+    // Runs are in increasing index order within each tile, tiles in the order they were touched
+    for (const Delta_Run& run : entry.runs) {
+	put_varint(out, run.index >= end ? (u64)(run.index - end) << 1 : (u64)(end - run.index) << 1 | 1);
+	put_varint(out, run.count);
+	end = run.index + run.count;
+    }
+    if (entry.uniform) return;
+    compress_pixels(entry.before, out);
+    compress_pixels(entry.after, out);
+}
+
+void decompress_entry(const u8* data, u64 size, Undo_Entry& entry) {
+    const u8* src = data;
+    entry.runs.resize(get_varint(src));
+    u32 end = 0;
+    u64 pixels = 0;
+    for (Delta_Run& run : entry.runs) {
+	u64 gap = get_varint(src);
+	run.index = gap & 1 ? end - (u32)(gap >> 1) : end + (u32)(gap >> 1);
+	run.count = get_varint(src);
+	end = run.index + run.count;
+	pixels += run.count;
+    }
+    if (entry.uniform) {
+	entry.before.clear();
+	entry.after.clear();
+	return;
+    }
+    entry.before.resize(pixels);
+    entry.after.resize(pixels);
+    src = decompress_pixels(src, entry.before.data(), pixels);
+    src = decompress_pixels(src, entry.after.data(), pixels);
+    assert(src == data + size);
+}
+
+// Decodes pixel tokens a few at a time, a token may cover several delta runs and the other way round
+struct Pixel_Reader {
+    const u8* src;
+    u64 left = 0;
+    bool repeat = false;
+    u32 pixel = 0;
+    void next() {
+	u64 token = get_varint(src);
+	left = token >> 1;
+	repeat = token & 1;
+	if (repeat) {
+	    memcpy(&pixel, src, sizeof(u32));
+	    src += sizeof(u32);
+	}
+    }
+    void read(u32* dst, u64 count) {
+	while (count) {
+	    if (!left) next();
+	    u64 n = std::min(count, left);
+	    if (repeat) std::fill(dst, dst + n, pixel);
+	    else {
+		memcpy(dst, src, n * sizeof(u32));
+		src += n * sizeof(u32);
+	    }
+	    dst += n;
+	    count -= n;
+	    left -= n;
+	}
+    }
+    void skip(u64 count) {
+	while (count) {
+	    if (!left) next();
+	    u64 n = std::min(count, left);
+	    if (!repeat) src += n * sizeof(u32);
+	    count -= n;
+	    left -= n;
+	}
+    }
+};
+
+// Writes one side of a compressed entry straight into the canvas, the other side is skipped
+// without being decoded
+static void apply_packed(Canvas& canvas, const u8* data, const Stored_Entry& stored, std::vector<Delta_Run>& runs, bool redo) {
+    const u8* src = data;
+    runs.resize(get_varint(src));
+    u32 end = 0;
+    u64 pixels = 0;
+    for (Delta_Run& run : runs) {
+	u64 gap = get_varint(src);
+	run.index = gap & 1 ? end - (u32)(gap >> 1) : end + (u32)(gap >> 1);
+	run.count = get_varint(src);
+	end = run.index + run.count;
+	pixels += run.count;
+    }
+    Pixel_Reader reader = {src};
+    if (redo && !stored.uniform) reader.skip(pixels);
+    u32 color = redo ? stored.after_color : stored.before_color;
+    for (const Delta_Run& run : runs) {
+	canvas.touch(run.index >> (2 * TILE_SHIFT));
+	u32* dst = canvas.pixels.data() + run.index;
+	if (stored.uniform) std::fill(dst, dst + run.count, color);
+	else reader.read(dst, run.count);
+    }
+}
+
+void History::begin(Canvas& canvas, int layer) {
+    edit_layer = layer;
+    if (!paused) canvas.begin_edit();
+}
+
+bool History::commit(Canvas& canvas) {
+    if (paused) return false;
+    assert(canvas.editing);
+    Undo_Entry entry;
+    entry.layer = edit_layer;
+    for (u64 i = 0; i < canvas.edit_tiles.size(); i++) {
+	u32 base = (u32)canvas.edit_tiles[i] << (2 * TILE_SHIFT);
+	const u32* before = canvas.edit_backup.data() + i * TILE_PIXELS;
+	const u32* after = canvas.tile(canvas.edit_tiles[i]);
+	int x = 0;
+	while (x < TILE_PIXELS) {
+	    if (before[x] == after[x]) {
+		x++;
+		continue;
+	    }
+	    int start = x;
+	    while (x < TILE_PIXELS && before[x] != after[x]) x++;
+	    entry.runs.push_back({base + start, (u32)(x - start)});
+	    entry.before.insert(entry.before.end(), before + start, before + x);
+	    entry.after.insert(entry.after.end(), after + start, after + x);
+	}
+    }
+    canvas.end_edit();
+    if (entry.runs.empty()) return false;
+    push(std::move(entry));
+    return true;
+}
+
+void History::push(Undo_Entry&& entry) {
+    if (paused) return;
+    if (ring.size() != budget) {
+	// Entries in a ring of another budget are lost
+	ring.assign(budget, 0);
+	bool spilled = std::all_of(entries.begin(), entries.end(), [](const Stored_Entry& stored) { return !stored.spill.empty(); });
+	if (!spilled) {
+	    entries.clear();
+	    root = current;
+	    root_redo = NO_NODE;
+	}
+	for (Stored_Entry& stored : entries) stored.offset = 0;
+	head = 0;
+    }
+    packed.clear();
+    compress_entry(entry, packed);
+    Stored_Entry stored;
+    stored.layer = entry.layer;
+    stored.uniform = entry.uniform;
+    stored.before_color = entry.before_color;
+    stored.after_color = entry.after_color;
+    stored.raw_bytes = entry.bytes();
+    stored.run_count = entry.runs.size();
+    stored.offset = head;
+    stored.serial = serial++;
+    if (packed.size() > budget) {
+	// The newest entry always stays so the last edit can be undone, even without room
+	entries.clear();
+	root = current;
+	stored.spill = packed;
+    }
+    else {
+	// Oldest first, their parents are gone already so they are children of the root
+	while (!entries.empty() && head + packed.size() - entries.front().offset > budget) {
+	    const Stored_Entry& oldest = entries.front();
+	    if (oldest.parent == root && oldest.on_path) {
+		root = oldest.serial;
+		root_redo = oldest.redo;
+	    }
+	    else if (root_redo == oldest.serial) root_redo = NO_NODE;
+	    entries.pop_front();
+	}
+	stored.size = packed.size();
+	u64 start = head % budget;
+	u64 first = std::min<u64>(packed.size(), budget - start);
+	memcpy(ring.data() + start, packed.data(), first);
+	memcpy(ring.data(), packed.data() + first, packed.size() - first);
+	head += packed.size();
+    }
+    stored.parent = current;
+    stored.on_path = true;
+    if (current == root) root_redo = stored.serial;
+    else node(current)->redo = stored.serial;
+    current = stored.serial;
+    entries.push_back(std::move(stored));
+}
+
+void History::skip() {
+    serial++;
+    // Nothing can be undone past the edit, the session never did without undoing it
+    entries.clear();
+    root = current;
+    root_redo = NO_NODE;
+}
+
+Stored_Entry* History::node(u64 id) {
+    return const_cast<Stored_Entry*>(static_cast<const History*>(this)->node(id));
+}
+
+const Stored_Entry* History::node(u64 id) const {
+    // Serials only grow, but skip() leaves gaps
+    auto found = std::lower_bound(entries.begin(), entries.end(), id, [](const Stored_Entry& stored, u64 id) { return stored.serial < id; });
+    return found != entries.end() && found->serial == id ? &*found : nullptr;
+}
+
+u64 History::redo_target() const {
+    u64 child = current == root ? root_redo : node(current)->redo;
+    return child != NO_NODE && node(child) ? child : NO_NODE;
+}
+
+void History::branches(std::vector<u64>& children) const {
+    children.clear();
+    // Children are newer than their parent
+    auto found = entries.begin();
+    if (current != root) found = std::upper_bound(entries.begin(), entries.end(), current, [](u64 id, const Stored_Entry& stored) { return id < stored.serial; });
+    for (; found != entries.end(); ++found) {
+	if (found->parent == current) children.push_back(found->serial);
+    }
+}
+
+bool History::select_branch(int step) {
+    std::vector<u64> children;
+    branches(children);
+    if (children.size() < 2) return false;
+    int count = children.size();
+    int at = std::find(children.begin(), children.end(), redo_target()) - children.begin();
+    // Without a redo target the first step lands on the oldest or newest branch
+    if (at == count) at = step > 0 ? count - 1 : 0;
+    return select_redo(children[((at + step) % count + count) % count]);
+}
+
+bool History::select_redo(u64 child) {
+    const Stored_Entry* stored = node(child);
+    if (!stored || stored->parent != current) return false;
+    if (current == root) root_redo = child;
+    else node(current)->redo = child;
+    return true;
+}
+
+const u8* History::stored_bytes(const Stored_Entry& stored) {
+    if (!stored.spill.empty()) return stored.spill.data();
+    u64 start = stored.offset % budget;
+    if (start + stored.size <= budget) return ring.data() + start;
+    // Wrapped around the end of the ring, put the two parts back together
+    u64 first = budget - start;
+    packed.resize(stored.size);
+    memcpy(packed.data(), ring.data() + start, first);
+    memcpy(packed.data() + first, ring.data(), stored.size - first);
+    return packed.data();
+}
+
+const Undo_Entry& History::load(const Stored_Entry& stored) {
+    scratch.uniform = stored.uniform;
+    scratch.layer = stored.layer;
+    scratch.before_color = stored.before_color;
+    scratch.after_color = stored.after_color;
+    u64 size = stored.spill.empty() ? stored.size : stored.spill.size();
+    decompress_entry(stored_bytes(stored), size, scratch);
+    return scratch;
+}
+
+bool History::undo(Canvas& canvas) {
+    if (canvas.editing || !can_undo()) return false;
+    Stored_Entry& stored = *node(current);
+    apply_packed(canvas, stored_bytes(stored), stored, scratch.runs, false);
+    stored.on_path = false;
+    current = stored.parent;
+    // Redo comes back here, whichever branch was taken before
+    if (current == root) root_redo = stored.serial;
+    else node(current)->redo = stored.serial;
+    return true;
+}
+
+bool History::redo(Canvas& canvas) {
+    if (canvas.editing || !can_redo()) return false;
+    Stored_Entry& stored = *node(redo_target());
+    apply_packed(canvas, stored_bytes(stored), stored, scratch.runs, true);
+    stored.on_path = true;
+    current = stored.serial;
+    return true;
+}
+
+void History::clear() {
+    entries.clear();
+    serial = 0;
+    root = root_redo = current = NO_NODE;
+    head = 0;
+}
+
+u64 History::used() const {
+    if (entries.empty()) return 0;
+    return entries.back().offset + entries.back().size - entries.front().offset;
+}
@@ -0,0 +1,120 @@
+#pragma once
+#include "canvas.hpp"
+#include <deque>
+
+// count pixels starting at canvas.pixels[index], never crossing a tile
+struct Delta_Run {
+    u32 index;
+    u32 count;
+};
+
+// The pixels one edit changed in one layer, with their values before and after.
+// A uniform entry changed every pixel from before_color to after_color, so it only keeps
+// the runs and leaves before and after empty.
+struct Undo_Entry {
+    int layer = 0;
+    std::vector<Delta_Run> runs;
+    std::vector<u32> before;
+    std::vector<u32> after;
+    bool uniform = false;
+    u32 before_color = 0;
+    u32 after_color = 0;
+    u64 bytes() const;
+};
+
+// Appends the compressed form of entry's runs and pixels to out. Run positions are stored as
+// varint gaps, the pixels as runs of one repeated value or of literals, which pixel art edits
+// mostly are.
+void compress_entry(const Undo_Entry& entry, std::vector<u8>& out);
+// Restores runs, before and after of entry from size bytes at data
+void decompress_entry(const u8* data, u64 size, Undo_Entry& entry);
+
+// No node: the parent of nodes made at the root, or nothing to redo
+const u64 NO_NODE = UINT64_MAX;
+
+// A node of the history tree, the edit that leads to it from its parent, and where its
+// compressed bytes start in the ring and how many there are
+struct Stored_Entry {
+    int layer = 0;
+    bool uniform = false;
+    u32 before_color = 0;
+    u32 after_color = 0;
+    // Position in the ring counting every byte ever written, the index is offset % capacity
+    u64 offset = 0;
+    u64 size = 0;
+    // Size of the uncompressed Undo_Entry
+    u64 raw_bytes = 0;
+    u32 run_count = 0;
+    // Number of entries pushed before this one, identifies the node
+    u64 serial = 0;
+    u64 parent = NO_NODE;
+    // The child redo goes to, the one last made or visited
+    u64 redo = NO_NODE;
+    // Between the root and the current node, both ends included
+    bool on_path = false;
+    // Entries larger than the whole ring are kept here instead
+    std::vector<u8> spill;
+};
+
+// Undo/redo tree made of pixel deltas. Edits are bracketed by begin() and commit(),
+// the canvas backs up the tiles an edit touches and commit() keeps only the pixels that
+// actually changed. Undo moves to the parent and redo to a child, an edit after an undo
+// starts a new branch next to what could be redone instead of dropping it. Each node only
+// stores its delta, so branches share everything before they fork and cost only the pixels
+// they change.
+// Entries are compressed into one ring of budget bytes, allocated on the first edit, and
+// the oldest are overwritten once it is full. The oldest is always a child of the root: on
+// the way to the current node it becomes the new root, else its branch is dropped.
+struct History {
+    u64 budget = 64 * 1024 * 1024;
+    std::vector<u8> ring;
+    // Next byte written, counted like Stored_Entry::offset
+    u64 head = 0;
+    // Oldest first, entries[i] has serial entries[0].serial + i. Nodes of dropped branches
+    // stay until the ring overwrites them.
+    std::deque<Stored_Entry> entries;
+    // Serial of the next entry
+    u64 serial = 0;
+    // The state nothing can be undone past, and its redo child
+    u64 root = NO_NODE;
+    u64 root_redo = NO_NODE;
+    u64 current = NO_NODE;
+    int edit_layer = 0;
+    // Edits leave no entries while paused, for replaying edits nothing will undo
+    bool paused = false;
+    // Scratch for compressing and for entries that wrap around the end of the ring
+    std::vector<u8> packed;
+    Undo_Entry scratch;
+    void begin(Canvas& canvas, int layer);
+    // Returns false when the edit didn't change anything
+    bool commit(Canvas& canvas);
+    // Adds an entry made without begin() and commit(), the pixels are already changed
+    void push(Undo_Entry&& entry);
+    // An edit replayed while paused that left an entry when it was made: it takes that
+    // entry's serial and becomes the root, there is nothing to undo or redo past it
+    void skip();
+    // The node with this serial, nullptr when overwritten
+    Stored_Entry* node(u64 id);
+    const Stored_Entry* node(u64 id) const;
+    u64 redo_target() const;
+    bool can_undo() const { return current != root; }
+    bool can_redo() const { return redo_target() != NO_NODE; }
+    int undo_layer() const { return node(current)->layer; }
+    int redo_layer() const { return node(redo_target())->layer; }
+    // Children of the current node, oldest first, the branches redo can take
+    void branches(std::vector<u64>& children) const;
+    // Makes redo take the child step branches after the current one, wrapping around.
+    // Returns false when there is no other branch.
+    bool select_branch(int step);
+    // Makes redo take child, returns false when it isn't a child of the current node
+    bool select_redo(u64 child);
+    bool undo(Canvas& canvas);
+    bool redo(Canvas& canvas);
+    void clear();
+    // Bytes of the ring holding entries
+    u64 used() const;
+    // The compressed bytes of a stored entry in one piece
+    const u8* stored_bytes(const Stored_Entry& stored);
+    // Decompresses a stored entry into scratch
+    const Undo_Entry& load(const Stored_Entry& stored);
+};
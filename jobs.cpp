@@ -0,0 +1,80 @@
+#include "jobs.hpp"
+#include <algorithm>
+
+Job_Pool::~Job_Pool() {
+    shutdown();
+}
+
+void Job_Pool::init(int worker_count) {
+    shutdown();
+    quit = false;
+    for (int i = 0; i < worker_count; i++) workers.emplace_back(&Job_Pool::work, this);
+}
+
+void Job_Pool::shutdown() {
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	quit = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers) worker.join();
+    workers.clear();
+}
+
+// Takes iterations until none are left
+void Job_Pool::run_items() {
+    while (true) {
+	int i = next.fetch_add(1);
+	if (i >= count) break;
+	(*body)(i);
+	done.fetch_add(1);
+    }
+}
+
+void Job_Pool::work() {
+    u64 seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+	wake.wait(lock, [&]() { return quit || loop_id != seen; });
+	if (quit) return;
+	seen = loop_id;
+	busy++;
+	lock.unlock();
+	run_items();
+	lock.lock();
+	// The caller waits for busy to drop so body and count stay valid while a worker is in run_items()
+	if (--busy == 0) finished.notify_all();
+    }
+}
+
+void Job_Pool::parallel_for(int count, const std::function<void(int)>& body) {
+    if (count <= 0) return;
+    if (workers.empty() || count == 1) {
+	for (int i = 0; i < count; i++) body(i);
+	return;
+    }
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	this->body = &body;
+	this->count = count;
+	next = 0;
+	done = 0;
+	loop_id++;
+    }
+    wake.notify_all();
+    run_items();
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&]() { return done == count && busy == 0; });
+    this->body = nullptr;
+}
+
+Job_Pool& job_pool() {
+    static Job_Pool pool;
+    static bool started = false;
+    if (!started) {
+	started = true;
+	int cores = (int)std::thread::hardware_concurrency();
+	pool.init(std::max(cores - 1, 0));
+    }
+    return pool;
+}
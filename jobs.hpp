@@ -0,0 +1,38 @@
+#pragma once
+#include "common.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads for data parallel loops over tiles or bands. The thread calling
+// parallel_for() works on the loop too, so the pool runs size() iterations at once.
+// One loop runs at a time, parallel_for() doesn't return before every iteration finished.
+struct Job_Pool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    // Current loop, changed under mutex. Workers pick up a loop when loop_id changes.
+    const std::function<void(int)>* body = nullptr;
+    int count = 0;
+    u64 loop_id = 0;
+    std::atomic<int> next{0};
+    std::atomic<int> done{0};
+    int busy = 0;
+    bool quit = false;
+    ~Job_Pool();
+    // Restarts the pool with the given number of worker threads, 0 runs loops on the caller only
+    void init(int worker_count);
+    void shutdown();
+    int size() const { return (int)workers.size() + 1; }
+    // Calls body(i) for every i in [0, count), in no particular order
+    void parallel_for(int count, const std::function<void(int)>& body);
+    void work();
+    void run_items();
+};
+
+// Shared pool with one thread per core, started on first use
+Job_Pool& job_pool();
@@ -0,0 +1,433 @@
+#include "journal.hpp"
+#include "canvas.hpp"
+#include "history.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#endif
+
+const char* journal_op_as_string(Journal_Op op) {
+    switch (op) {
+    case JOURNAL_INIT:
+	return "Init";
+    case JOURNAL_ADD_LAYER:
+	return "Add layer";
+    case JOURNAL_SELECT_LAYER:
+	return "Select layer";
+    case JOURNAL_SET_VISIBLE:
+	return "Set visible";
+    case JOURNAL_SET_OPACITY:
+	return "Set opacity";
+    case JOURNAL_SET_BLEND:
+	return "Set blend";
+    case JOURNAL_SET_PIXEL:
+	return "Set pixel";
+    case JOURNAL_BRUSH_STAMP:
+	return "Brush stamp";
+    case JOURNAL_BEGIN_STROKE:
+	return "Begin stroke";
+    case JOURNAL_STROKE_TO:
+	return "Stroke to";
+    case JOURNAL_END_STROKE:
+	return "End stroke";
+    case JOURNAL_LINE:
+	return "Line";
+    case JOURNAL_SPANS:
+	return "Spans";
+    case JOURNAL_FILL:
+	return "Fill";
+    case JOURNAL_REPLACE_COLOR:
+	return "Replace color";
+    case JOURNAL_UNDO:
+	return "Undo";
+    case JOURNAL_REDO:
+	return "Redo";
+    case JOURNAL_SAVE_BEGIN:
+	return "Save begin";
+    case JOURNAL_SAVE_DONE:
+	return "Save done";
+    case JOURNAL_SELECT_BRANCH:
+	return "Select branch";
+    case JOURNAL_OP_MAX:
+	assert(0);
+    }
+    assert(0);
+    return "";
+}
+
+const u64 FNV_OFFSET = 0xCBF29CE484222325ull;
+const u64 FNV_PRIME = 0x100000001B3ull;
+
+static u64 checksum(const u8* data, u64 size) {
+    u64 hash = FNV_OFFSET;
+    for (u64 i = 0; i < size; i++) hash = (hash ^ data[i]) * FNV_PRIME;
+    return hash;
+}
+
+u64 journal_hash(const u32* pixels, u64 count, bool& opaque) {
+    u64 hash = FNV_OFFSET;
+    u32 alpha = 0xFF000000;
+    for (u64 i = 0; i < count; i++) {
+	hash = (hash ^ pixels[i]) * FNV_PRIME;
+	alpha &= pixels[i];
+    }
+    opaque = alpha == 0xFF000000;
+    return hash;
+}
+
+#ifdef _WIN32
+static int open_file(const char* path) { return _open(path, _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE); }
+static bool truncate_file(int file, u64 size) { return _chsize_s(file, size) == 0; }
+static bool sync_file(int file) { return _commit(file) == 0; }
+static void close_file(int file) { _close(file); }
+static bool write_file(int file, const u8* data, u64 size) {
+    while (size > 0) {
+	int written = _write(file, data, (unsigned)std::min<u64>(size, 1 << 30));
+	if (written <= 0) return false;
+	data += written;
+	size -= written;
+    }
+    return true;
+}
+#else
+static int open_file(const char* path) { return open(path, O_WRONLY | O_CREAT | O_APPEND, 0644); }
+static bool truncate_file(int file, u64 size) { return ftruncate(file, size) == 0; }
+static bool sync_file(int file) { return fsync(file) == 0; }
+static void close_file(int file) { close(file); }
+static bool write_file(int file, const u8* data, u64 size) {
+    while (size > 0) {
+	ssize_t written = write(file, data, size);
+	if (written <= 0) return false;
+	data += written;
+	size -= written;
+    }
+    return true;
+}
+#endif
+
+// Writes whatever flush() handed over as one frame, then syncs once JOURNAL_SYNC_MS passed
+// since the last sync. Between frames it sleeps until there is more, or until the unsynced
+// frames are due.
+static void write_frames(Journal_State* state) {
+    typedef std::chrono::steady_clock Clock;
+    std::vector<u8> frame;
+    Clock::time_point last_sync = Clock::now();
+    bool unsynced = false;
+    std::unique_lock<std::mutex> lock(state->mutex);
+    for (;;) {
+	if (state->pending.empty() && !state->quit) {
+	    if (unsynced) state->wake.wait_until(lock, last_sync + std::chrono::milliseconds(JOURNAL_SYNC_MS));
+	    else state->wake.wait(lock);
+	}
+	bool quit = state->quit;
+	frame.resize(sizeof(Journal_Frame));
+	frame.insert(frame.end(), state->pending.begin(), state->pending.end());
+	state->pending.clear();
+	lock.unlock();
+	if (frame.size() > sizeof(Journal_Frame) && !state->failed) {
+	    Journal_Frame header = {JOURNAL_MAGIC, (u32)(frame.size() - sizeof(header)), 0};
+	    header.checksum = checksum(frame.data() + sizeof(header), header.size);
+	    memcpy(frame.data(), &header, sizeof(header));
+	    if (!write_file(state->file, frame.data(), frame.size())) state->failed = true;
+	    unsynced = true;
+	}
+	if (unsynced && (quit || Clock::now() - last_sync >= std::chrono::milliseconds(JOURNAL_SYNC_MS))) {
+	    if (!state->failed && !sync_file(state->file)) state->failed = true;
+	    unsynced = false;
+	    last_sync = Clock::now();
+	}
+	lock.lock();
+	if (quit && state->pending.empty()) return;
+    }
+}
+
+bool Journal::open(const char* path, u64 valid_bytes) {
+    if (is_open()) close();
+    int file = open_file(path);
+    if (file < 0) return false;
+    // A frame cut short by a crash would hide every frame written after it
+    if (!truncate_file(file, valid_bytes)) {
+	close_file(file);
+	return false;
+    }
+    this->path = path;
+    records.clear();
+    stamp.clear();
+    state = std::make_shared<Journal_State>();
+    state->file = file;
+    Journal_State* writer = state.get();
+    state->thread = std::thread([writer]() { write_frames(writer); });
+    return true;
+}
+
+void Journal::flush() {
+    if (!is_open() || records.empty()) return;
+    {
+	std::lock_guard<std::mutex> lock(state->mutex);
+	state->pending.insert(state->pending.end(), records.begin(), records.end());
+    }
+    state->wake.notify_one();
+    records.clear();
+}
+
+void Journal::close() {
+    if (!is_open()) return;
+    flush();
+    {
+	std::lock_guard<std::mutex> lock(state->mutex);
+	state->quit = true;
+    }
+    state->wake.notify_one();
+    state->thread.join();
+    close_file(state->file);
+    state.reset();
+}
+
+void Journal::discard() {
+    if (!is_open()) return;
+    close();
+    std::remove(path.c_str());
+}
+
+bool read_journal(const char* path, std::vector<u8>& records, u64& valid_bytes) {
+    records.clear();
+    valid_bytes = 0;
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+    std::vector<u8> data;
+    u8 buffer[1 << 16];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) data.insert(data.end(), buffer, buffer + count);
+    fclose(file);
+    records.reserve(data.size());
+    while (valid_bytes + sizeof(Journal_Frame) <= data.size()) {
+	Journal_Frame header;
+	memcpy(&header, data.data() + valid_bytes, sizeof(header));
+	const u8* frame = data.data() + valid_bytes + sizeof(header);
+	if (header.magic != JOURNAL_MAGIC || header.size > data.size() - valid_bytes - sizeof(header)) break;
+	if (checksum(frame, header.size) != header.checksum) break;
+	records.insert(records.end(), frame, frame + header.size);
+	valid_bytes += sizeof(header) + header.size;
+    }
+    return true;
+}
+
+static u64 fields_size(Journal_Op op) {
+    switch (op) {
+    case JOURNAL_INIT:
+	return sizeof(Journal_Init);
+    case JOURNAL_ADD_LAYER:
+    case JOURNAL_UNDO:
+    case JOURNAL_REDO:
+	return 0;
+    case JOURNAL_SELECT_LAYER:
+    case JOURNAL_SET_VISIBLE:
+    case JOURNAL_SET_OPACITY:
+    case JOURNAL_SET_BLEND:
+	return sizeof(Journal_Value);
+    case JOURNAL_SET_PIXEL:
+	return sizeof(Journal_Pixel);
+    case JOURNAL_BRUSH_STAMP:
+	return sizeof(Journal_Stamp);
+    case JOURNAL_BEGIN_STROKE:
+	return sizeof(Journal_Stroke);
+    case JOURNAL_STROKE_TO:
+	return sizeof(Journal_Point);
+    case JOURNAL_END_STROKE:
+	return sizeof(Journal_End);
+    case JOURNAL_LINE:
+	return sizeof(Journal_Line);
+    case JOURNAL_SPANS:
+	return sizeof(Journal_Spans);
+    case JOURNAL_FILL:
+	return sizeof(Journal_Fill);
+    case JOURNAL_REPLACE_COLOR:
+	return sizeof(Journal_Replace);
+    case JOURNAL_SAVE_BEGIN:
+	return sizeof(Journal_Save);
+    case JOURNAL_SAVE_DONE:
+	return sizeof(Journal_Saved);
+    case JOURNAL_SELECT_BRANCH:
+	return sizeof(Journal_Branch);
+    case JOURNAL_OP_MAX:
+	assert(0);
+    }
+    assert(0);
+    return 0;
+}
+
+bool Journal_Reader::next() {
+    if (offset >= size || data[offset] >= JOURNAL_OP_MAX) return false;
+    Journal_Op op = (Journal_Op)data[offset];
+    u64 fields_end = offset + 1 + fields_size(op);
+    if (fields_end > size) return false;
+    u64 array_size = 0;
+    if (op == JOURNAL_SPANS) {
+	Journal_Spans spans;
+	memcpy(&spans, data + offset + 1, sizeof(spans));
+	array_size = (u64)spans.count * sizeof(Span);
+    }
+    else if (op == JOURNAL_BRUSH_STAMP) {
+	Journal_Stamp stamp;
+	memcpy(&stamp, data + offset + 1, sizeof(stamp));
+	if (stamp.size < 0) return false;
+	array_size = (u64)stamp.size * stamp.size;
+    }
+    if (array_size > size - fields_end) return false;
+    this->op = op;
+    fields = data + offset + 1;
+    array = data + fields_end;
+    offset = fields_end + array_size;
+    return true;
+}
+
+void plan_from_start(Journal_Plan& plan) {
+    plan.from_save = false;
+    plan.start = 1 + sizeof(Journal_Init);
+    plan.first_edit = 0;
+    plan.first_serial = 0;
+}
+
+// A save the replay could start from. Edits numbered below edits happened before it, and
+// serials of the undo entries they pushed.
+struct Save_Marker {
+    u64 start;
+    u64 edits;
+    u64 serials;
+    Journal_Save save;
+    bool done;
+    Journal_Saved saved;
+};
+
+// A node of the undo tree, made by the edit numbered edit
+struct Journal_Node {
+    u64 edit;
+    u64 parent;
+    u64 redo;
+};
+
+// An undo or redo and the edit it undid or redid
+struct Journal_Undo {
+    u64 offset;
+    u64 edit;
+};
+
+bool plan_replay(const std::vector<u8>& records, Journal_Plan& plan) {
+    Journal_Reader reader = {records.data(), records.size()};
+    if (!reader.next() || reader.op != JOURNAL_INIT) return false;
+    plan.init = reader.get<Journal_Init>();
+    plan_from_start(plan);
+    std::vector<Save_Marker> markers;
+    std::vector<Journal_Undo> undos;
+    // The undo tree as History keeps it, by serial. The root is NO_NODE, nothing is ever
+    // overwritten here.
+    std::vector<Journal_Node> nodes;
+    u64 current = NO_NODE;
+    u64 root_redo = NO_NODE;
+    u64 edits = 0;
+    u64 stroke_edit = 0;
+    bool stroke_open = false;
+    auto redo_of = [&](u64 node) -> u64& { return node == NO_NODE ? root_redo : nodes[node].redo; };
+    auto edit = [&](bool pushed, u64 number) {
+	if (!pushed) return;
+	nodes.push_back({number, current, NO_NODE});
+	u64 parent = current;
+	current = nodes.size() - 1;
+	redo_of(parent) = current;
+    };
+    while (reader.next()) {
+	switch (reader.op) {
+	case JOURNAL_SET_PIXEL:
+	    edit(reader.get<Journal_Pixel>().pushed, edits++);
+	    break;
+	case JOURNAL_BEGIN_STROKE:
+	    stroke_edit = edits++;
+	    stroke_open = true;
+	    break;
+	case JOURNAL_END_STROKE:
+	    edit(reader.get<Journal_End>().pushed, stroke_edit);
+	    stroke_open = false;
+	    break;
+	case JOURNAL_LINE:
+	    edit(reader.get<Journal_Line>().pushed, edits++);
+	    break;
+	case JOURNAL_SPANS:
+	    edit(reader.get<Journal_Spans>().pushed, edits++);
+	    break;
+	case JOURNAL_FILL:
+	    edit(reader.get<Journal_Fill>().pushed, edits++);
+	    break;
+	case JOURNAL_REPLACE_COLOR:
+	    edit(reader.get<Journal_Replace>().pushed, edits++);
+	    break;
+	case JOURNAL_UNDO: {
+	    if (current == NO_NODE) break;
+	    undos.push_back({reader.offset, nodes[current].edit});
+	    u64 undone = current;
+	    current = nodes[current].parent;
+	    redo_of(current) = undone;
+	    break;
+	}
+	case JOURNAL_REDO:
+	    if (redo_of(current) == NO_NODE) break;
+	    current = redo_of(current);
+	    undos.push_back({reader.offset, nodes[current].edit});
+	    break;
+	case JOURNAL_SELECT_BRANCH: {
+	    u64 child = reader.get<Journal_Branch>().serial;
+	    if (child < nodes.size() && nodes[child].parent == current) redo_of(current) = child;
+	    break;
+	}
+	case JOURNAL_SAVE_BEGIN:
+	    markers.push_back({reader.offset, edits, nodes.size(), reader.get<Journal_Save>(), false, {}});
+	    markers.back().save.path[sizeof(markers.back().save.path) - 1] = 0;
+	    break;
+	case JOURNAL_SAVE_DONE: {
+	    Journal_Saved saved = reader.get<Journal_Saved>();
+	    for (size_t i = markers.size(); i-- > 0;) {
+		if (markers[i].save.id != saved.id) continue;
+		markers[i].done = true;
+		markers[i].saved = saved;
+		break;
+	    }
+	    break;
+	}
+	default:
+	    break;
+	}
+    }
+    plan.edits = edits;
+    plan.keep.assign(edits, 0);
+    for (const Journal_Undo& undo : undos) plan.keep[undo.edit] = 1;
+    u64 node = current;
+    for (int depth = 0; node != NO_NODE && depth < JOURNAL_UNDO_DEPTH; depth++, node = nodes[node].parent) plan.keep[nodes[node].edit] = 1;
+    // A stroke the journal ends in is ended after the replay, as an edit of its own
+    if (stroke_open) plan.keep[stroke_edit] = 1;
+    // Newest save first. A later save to the same path, even an unfinished one, replaced the file.
+    std::vector<std::string> overwritten;
+    u64 earliest_undone = UINT64_MAX;
+    size_t undo = undos.size();
+    for (size_t i = markers.size(); i-- > 0;) {
+	const Save_Marker& marker = markers[i];
+	while (undo > 0 && undos[undo - 1].offset > marker.start) earliest_undone = std::min(earliest_undone, undos[--undo].edit);
+	bool replaced = std::find(overwritten.begin(), overwritten.end(), marker.save.path) != overwritten.end();
+	overwritten.push_back(marker.save.path);
+	if (replaced || !marker.done || !marker.save.exact || !marker.saved.opaque) continue;
+	// Undoing or redoing an edit from before the save needs an undo entry the save doesn't have
+	if (earliest_undone < marker.edits) continue;
+	plan.from_save = true;
+	plan.start = marker.start;
+	plan.first_edit = marker.edits;
+	plan.first_serial = marker.serials;
+	plan.save = marker.save;
+	plan.saved = marker.saved;
+	break;
+    }
+    return true;
+}
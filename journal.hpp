@@ -0,0 +1,237 @@
+#pragma once
+#include "common.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One record per editor call that changes the sprite. A record is the op byte followed by
+// that op's fields struct, SPANS and BRUSH_STAMP are followed by their arrays.
+enum Journal_Op {
+    JOURNAL_INIT, JOURNAL_ADD_LAYER, JOURNAL_SELECT_LAYER, JOURNAL_SET_VISIBLE, JOURNAL_SET_OPACITY,
+    JOURNAL_SET_BLEND, JOURNAL_SET_PIXEL, JOURNAL_BRUSH_STAMP, JOURNAL_BEGIN_STROKE, JOURNAL_STROKE_TO,
+    JOURNAL_END_STROKE, JOURNAL_LINE, JOURNAL_SPANS, JOURNAL_FILL, JOURNAL_REPLACE_COLOR, JOURNAL_UNDO,
+    JOURNAL_REDO, JOURNAL_SAVE_BEGIN, JOURNAL_SAVE_DONE, JOURNAL_SELECT_BRANCH,
+    JOURNAL_OP_MAX
+};
+
+const char* journal_op_as_string(Journal_Op op);
+
+// Fields of the records, written as they are in memory. Edits remember whether they pushed an
+// undo entry, so recovery can follow the undo tree without replaying them.
+struct Journal_Init {
+    int width;
+    int height;
+    u32 color;
+};
+
+struct Journal_Value {
+    int value;
+};
+
+struct Journal_Pixel {
+    int x;
+    int y;
+    u32 color;
+    u8 symmetry;
+    u8 pushed;
+};
+
+// Followed by size * size coverage bytes
+struct Journal_Stamp {
+    int size;
+};
+
+struct Journal_Stroke {
+    int x;
+    int y;
+    u32 color;
+    int size;
+    float hardness;
+    u8 shape;
+    u8 mode;
+    u8 symmetry;
+};
+
+struct Journal_Point {
+    int x;
+    int y;
+};
+
+struct Journal_End {
+    u8 pushed;
+};
+
+struct Journal_Line {
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    u32 color;
+    u8 width;
+    u8 aa;
+    u8 symmetry;
+    u8 pushed;
+};
+
+// Followed by count Spans
+struct Journal_Spans {
+    u32 count;
+    u32 color;
+    u8 symmetry;
+    u8 pushed;
+};
+
+struct Journal_Fill {
+    int x;
+    int y;
+    u32 color;
+    int tolerance;
+    u8 metric;
+    u8 symmetry;
+    u8 pushed;
+};
+
+struct Journal_Replace {
+    u32 from;
+    u32 to;
+    u8 pushed;
+};
+
+// Redo takes the branch made by the serial-th edit that pushed an undo entry
+struct Journal_Branch {
+    u64 serial;
+};
+
+// A save of the composite started. Only a save of a single visible, opaque, normal layer
+// outside a stroke can be the starting point of a recovery, exact says whether this one is.
+struct Journal_Save {
+    u32 id;
+    u8 exact;
+    char path[256];
+};
+
+// The save finished and wrote pixels with this hash, opaque when every alpha was 255
+struct Journal_Saved {
+    u64 hash;
+    u32 id;
+    u8 opaque;
+};
+
+// Hash of width * height row-major pixels, sets opaque to whether every alpha is 255
+u64 journal_hash(const u32* pixels, u64 count, bool& opaque);
+
+// Records are handed to a writer thread in frames of a header and the records. The header's
+// checksum catches a frame cut short when the app died while writing it.
+struct Journal_Frame {
+    u32 magic;
+    u32 size;
+    u64 checksum;
+};
+
+const u32 JOURNAL_MAGIC = 0x314A5053;
+// Time between fsyncs while records keep coming in, at most this much work is lost
+const int JOURNAL_SYNC_MS = 250;
+
+struct Journal_State {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    // Frames waiting for the writer
+    std::vector<u8> pending;
+    bool quit = false;
+    std::atomic<bool> failed{false};
+    int file = -1;
+};
+
+// Append-only log of edits for crash recovery. Editor calls append records to a buffer that
+// flush() hands to the writer thread once per frame. The writer appends them to the file and
+// syncs at most every JOURNAL_SYNC_MS, or when closing.
+struct Journal {
+    std::shared_ptr<Journal_State> state;
+    std::string path;
+    std::vector<u8> records;
+    // Last brush stamp journaled, a stroke with another one journals it first
+    std::vector<u8> stamp;
+    u32 save_id = 0;
+    bool is_open() const { return state != nullptr; }
+    // Appends to the file at path, dropping anything after its first valid_bytes bytes
+    bool open(const char* path, u64 valid_bytes);
+    template <typename Fields>
+    void add(Journal_Op op, const Fields& fields) {
+	if (!is_open()) return;
+	records.push_back((u8)op);
+	add_bytes(&fields, sizeof(fields));
+    }
+    void add_bytes(const void* data, u64 size) {
+	u64 at = records.size();
+	records.resize(at + size);
+	memcpy(records.data() + at, data, size);
+    }
+    void add(Journal_Op op) {
+	if (is_open()) records.push_back((u8)op);
+    }
+    // Hands this frame's records to the writer
+    void flush();
+    // True once a write or sync failed, nothing more is written then
+    bool failed() const { return state && state->failed; }
+    // Writes and syncs everything, then stops the writer
+    void close();
+    // Closes and deletes the file, after a clean exit nothing needs recovering
+    void discard();
+};
+
+// Reads the records of every intact frame of the journal at path. valid_bytes is where the
+// intact frames end. Returns false when there is no journal.
+bool read_journal(const char* path, std::vector<u8>& records, u64& valid_bytes);
+
+// Steps through records, returning false at the end or at a record that doesn't fit
+struct Journal_Reader {
+    const u8* data;
+    u64 size;
+    u64 offset = 0;
+    Journal_Op op = JOURNAL_OP_MAX;
+    // Fields of the current record, and its array for SPANS and BRUSH_STAMP
+    const u8* fields = nullptr;
+    const u8* array = nullptr;
+    bool next();
+    template <typename Fields>
+    Fields get() const {
+	Fields value;
+	memcpy(&value, fields, sizeof(value));
+	return value;
+    }
+};
+
+// Undo entries recovery has to rebuild besides those a later undo reaches, so the newest
+// edits stay undoable after a recovery
+const int JOURNAL_UNDO_DEPTH = 256;
+
+// What recovery replays. Edits are numbered in journal order, only those in keep get an undo
+// entry, the others are replayed with history paused.
+struct Journal_Plan {
+    Journal_Init init = {0, 0, 0};
+    // Offset of the first record to replay
+    u64 start = 0;
+    // Number of the first edit replayed
+    u64 first_edit = 0;
+    // Undo entries pushed before the first record replayed. Replay starts numbering entries
+    // here so select branch records name the same ones.
+    u64 first_serial = 0;
+    u64 edits = 0;
+    std::vector<u8> keep;
+    // Save to load before replaying, when the plan starts at one
+    bool from_save = false;
+    Journal_Save save;
+    Journal_Saved saved;
+};
+
+// Follows the undo tree through the records. Starts at the newest finished exact save that
+// no later undo reaches back past, else at the first record. Returns false without an INIT.
+bool plan_replay(const std::vector<u8>& records, Journal_Plan& plan);
+// The plan when the save can't be loaded after all: replay everything
+void plan_from_start(Journal_Plan& plan);
@@ -0,0 +1,204 @@
+#include "labels.hpp"
+#include <algorithm>
+#include <cstring>
+
+static u32 find_root(std::vector<u32>& parent, u32 run) {
+    while (parent[run] != run) {
+	// Path halving
+	parent[run] = parent[parent[run]];
+	run = parent[run];
+    }
+    return run;
+}
+
+void Region_Labels::build(const Canvas& canvas) {
+    width = canvas.width;
+    height = canvas.height;
+    row_start.assign(height + 1, 0);
+    row_runs.clear();
+    std::vector<u32> colors;
+    for (int y = 0; y < height; y++) {
+	row_start[y] = row_runs.size();
+	int x = 0;
+	while (x < width) {
+	    u32 color = canvas.get(x, y);
+	    int start = x;
+	    // Whole tile rows are contiguous, walk them without recomputing the index
+	    while (x < width) {
+		const u32* src = canvas.pixels.data() + canvas.index(x, y);
+		int end = std::min((x | (TILE_SIZE - 1)) + 1, width);
+		int i = 0;
+		while (x + i < end && src[i] == color) i++;
+		x += i;
+		if (x < end) break;
+	    }
+	    row_runs.push_back({y, start, x});
+	    colors.push_back(color);
+	}
+    }
+    row_start[height] = row_runs.size();
+
+    std::vector<u32> parent(row_runs.size());
+    for (u32 i = 0; i < parent.size(); i++) parent[i] = i;
+    for (int y = 1; y < height; y++) {
+	u32 a = row_start[y - 1];
+	u32 b = row_start[y];
+	// Both rows are sorted, step past whichever run ends first
+	while (a < row_start[y] && b < row_start[y + 1]) {
+	    const Span& above = row_runs[a];
+	    const Span& run = row_runs[b];
+	    if (colors[a] == colors[b] && above.x0 < run.x1 && run.x0 < above.x1) {
+		u32 root_a = find_root(parent, a);
+		u32 root_b = find_root(parent, b);
+		// The older run stays root so region ids follow the first pixel of each region
+		if (root_a != root_b) parent[std::max(root_a, root_b)] = std::min(root_a, root_b);
+	    }
+	    if (above.x1 < run.x1) a++;
+	    else b++;
+	}
+    }
+
+    regions.clear();
+    row_region.resize(row_runs.size());
+    for (u32 i = 0; i < row_runs.size(); i++) {
+	u32 root = find_root(parent, i);
+	if (root == i) {
+	    row_region[i] = regions.size();
+	    regions.push_back({});
+	    regions.back().color = colors[i];
+	    regions.back().min_x = width;
+	    regions.back().min_y = height;
+	}
+	else row_region[i] = row_region[root];
+	Region& region = regions[row_region[i]];
+	const Span& run = row_runs[i];
+	region.run_count++;
+	region.pixels += run.x1 - run.x0;
+	region.min_x = std::min(region.min_x, run.x0);
+	region.max_x = std::max(region.max_x, run.x1 - 1);
+	region.min_y = std::min(region.min_y, run.y);
+	region.max_y = std::max(region.max_y, run.y);
+    }
+    // Counting sort of the runs by region
+    u32 offset = 0;
+    for (Region& region : regions) {
+	region.first = offset;
+	offset += region.run_count;
+	region.run_count = 0;
+    }
+    runs.resize(row_runs.size());
+    for (u32 i = 0; i < row_runs.size(); i++) {
+	Region& region = regions[row_region[i]];
+	runs[region.first + region.run_count++] = row_runs[i];
+    }
+}
+
+int Region_Labels::region_at(int x, int y) const {
+    if (x < 0 || y < 0 || x >= width || y >= height) return -1;
+    const Span* begin = row_runs.data() + row_start[y];
+    const Span* end = row_runs.data() + row_start[y + 1];
+    const Span* run = std::upper_bound(begin, end, x, [](int x, const Span& run) { return x < run.x1; });
+    return run == end ? -1 : row_region[run - row_runs.data()];
+}
+
+bool Label_Cache::stale(const Canvas& canvas, int layer) const {
+    if (!ready || layer != this->layer || canvas.width != labels.width || canvas.height != labels.height) return true;
+    for (int tile = 0; tile < canvas.tile_count(); tile++) {
+	if (canvas.changed_since(tile, checkpoint)) return true;
+    }
+    return false;
+}
+
+bool Label_Cache::start(Canvas& canvas, int layer) {
+    if (busy() || canvas.editing) return false;
+    state = std::make_shared<Label_State>();
+    if (snapshot && snapshot_layer == layer && snapshot->width == canvas.width && snapshot->height == canvas.height) {
+	for (int tile = 0; tile < canvas.tile_count(); tile++) {
+	    if (canvas.changed_since(tile, snapshot_checkpoint)) memcpy(snapshot->tile(tile), canvas.tile(tile), TILE_PIXELS * sizeof(u32));
+	}
+    }
+    else {
+	// Only the pixels are needed, a single copy of the tile buffer
+	snapshot = std::make_shared<Canvas>();
+	snapshot->width = canvas.width;
+	snapshot->height = canvas.height;
+	snapshot->tiles_x = canvas.tiles_x;
+	snapshot->tiles_y = canvas.tiles_y;
+	snapshot->pixels = canvas.pixels;
+    }
+    snapshot_layer = layer;
+    pending_layer = layer;
+    pending_checkpoint = snapshot_checkpoint = canvas.checkpoint();
+    state->snapshot = snapshot;
+    Label_State* job = state.get();
+    job->thread = std::thread([job]() {
+	job->labels.build(*job->snapshot);
+	job->finished = true;
+    });
+    return true;
+}
+
+bool Label_Cache::poll() {
+    if (!busy() || !state->finished) return false;
+    state->thread.join();
+    labels = std::move(state->labels);
+    layer = pending_layer;
+    checkpoint = pending_checkpoint;
+    ready = true;
+    state.reset();
+    return true;
+}
+
+void Label_Cache::wait() {
+    if (!busy()) return;
+    state->thread.join();
+    state.reset();
+}
+
+void Label_Cache::clear() {
+    wait();
+    ready = false;
+    layer = -1;
+    snapshot.reset();
+    snapshot_layer = -1;
+}
+
+bool Label_Cache::region_valid(const Canvas& canvas, const Region& region) const {
+    // Usually nothing changed near the region since the build, then its runs needn't be walked
+    int x0 = std::max(region.min_x - 1, 0) >> TILE_SHIFT;
+    int x1 = std::min(region.max_x + 1, canvas.width - 1) >> TILE_SHIFT;
+    int y0 = std::max(region.min_y - 1, 0) >> TILE_SHIFT;
+    int y1 = std::min(region.max_y + 1, canvas.height - 1) >> TILE_SHIFT;
+    bool changed = false;
+    for (int ty = y0; ty <= y1 && !changed; ty++) {
+	for (int tx = x0; tx <= x1; tx++) {
+	    if (canvas.changed_since(ty * canvas.tiles_x + tx, checkpoint)) {
+		changed = true;
+		break;
+	    }
+	}
+    }
+    if (!changed) return true;
+    for (u32 i = region.first; i < region.first + region.run_count; i++) {
+	const Span& run = labels.runs[i];
+	// The run and its neighbours above, below and at both ends
+	int x0 = std::max(run.x0 - 1, 0) >> TILE_SHIFT;
+	int x1 = std::min(run.x1, canvas.width - 1) >> TILE_SHIFT;
+	int y0 = std::max(run.y - 1, 0) >> TILE_SHIFT;
+	int y1 = std::min(run.y + 1, canvas.height - 1) >> TILE_SHIFT;
+	for (int ty = y0; ty <= y1; ty++) {
+	    for (int tx = x0; tx <= x1; tx++) {
+		if (canvas.changed_since(ty * canvas.tiles_x + tx, checkpoint)) return false;
+	    }
+	}
+    }
+    return true;
+}
+
+const Region* Label_Cache::lookup(const Canvas& canvas, int layer, int x, int y) const {
+    if (!ready || layer != this->layer || canvas.width != labels.width || canvas.height != labels.height) return nullptr;
+    int index = labels.region_at(x, y);
+    if (index < 0) return nullptr;
+    const Region& region = labels.regions[index];
+    return region_valid(canvas, region) ? &region : nullptr;
+}
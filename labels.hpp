@@ -0,0 +1,76 @@
+#pragma once
+#include "canvas.hpp"
+#include <atomic>
+#include <memory>
+#include <thread>
+
+// A 4-connected area of one exact color, the same pixels an exact flood fill would reach
+struct Region {
+    u32 color = 0;
+    u64 pixels = 0;
+    // runs[first, first + run_count) of Region_Labels::runs
+    u32 first = 0;
+    u32 run_count = 0;
+    // Bounding box, inclusive
+    int min_x = 0;
+    int min_y = 0;
+    int max_x = -1;
+    int max_y = -1;
+};
+
+// Every region of a canvas. Each row is split into runs of one color, runs that touch a run
+// of the same color in the row above are joined with union-find.
+struct Region_Labels {
+    int width = 0;
+    int height = 0;
+    std::vector<Region> regions;
+    // Runs grouped by region, in row order within a region
+    std::vector<Span> runs;
+    // Runs in row order, row y is [row_start[y], row_start[y + 1]), with the region of each
+    std::vector<u32> row_start;
+    std::vector<Span> row_runs;
+    std::vector<u32> row_region;
+    void build(const Canvas& canvas);
+    int region_at(int x, int y) const;
+};
+
+struct Label_State {
+    std::thread thread;
+    std::atomic<bool> finished{false};
+    std::shared_ptr<const Canvas> snapshot;
+    Region_Labels labels;
+};
+
+// Region labels of one layer, built on a worker thread from a copy of the canvas. The canvas
+// keeps changing meanwhile, so the labels remember the generation of the copy: a region is
+// still exact as long as no tile holding one of its pixels or one of their neighbours changed
+// since then. Other regions stay usable until the next build replaces the labels.
+struct Label_Cache {
+    std::shared_ptr<Label_State> state;
+    Region_Labels labels;
+    bool ready = false;
+    int layer = -1;
+    // Tiles written after this generation changed since the labels' snapshot
+    u64 checkpoint = 0;
+    int pending_layer = -1;
+    u64 pending_checkpoint = 0;
+    // Pixels of the layer the last build started from. The next build of the same layer only
+    // copies the tiles changed since snapshot_checkpoint into it, no build is reading it then.
+    std::shared_ptr<Canvas> snapshot;
+    int snapshot_layer = -1;
+    u64 snapshot_checkpoint = 0;
+    bool busy() const { return state != nullptr; }
+    // Whether the canvas changed since the labels were taken, or they belong to another layer
+    bool stale(const Canvas& canvas, int layer) const;
+    // Returns false while another build is still running, or during an edit of the canvas
+    bool start(Canvas& canvas, int layer);
+    // Returns true once after a build finished and its labels became current
+    bool poll();
+    // Waits for a running build and drops it
+    void wait();
+    // Drops the labels and the snapshot, for a canvas that was initialized again
+    void clear();
+    bool region_valid(const Canvas& canvas, const Region& region) const;
+    // Region at (x, y) if the labels cover this layer and the region is still exact, else nullptr
+    const Region* lookup(const Canvas& canvas, int layer, int x, int y) const;
+};
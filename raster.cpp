@@ -0,0 +1,352 @@
+#include "raster.hpp"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+
+void rasterize_line(int x0, int y0, int x1, int y1, std::vector<Span>& spans) {
+    int dx = abs(x1 - x0);
+    int dy = -abs(y1 - y0);
+    int step_x = x0 < x1 ? 1 : -1;
+    int step_y = y0 < y1 ? 1 : -1;
+    int err = dx + dy;
+    Span span = {y0, x0, x0 + 1};
+    while (x0 != x1 || y0 != y1) {
+	int err2 = err * 2;
+	if (err2 >= dy) {
+	    err += dy;
+	    x0 += step_x;
+	}
+	if (err2 <= dx) {
+	    err += dx;
+	    y0 += step_y;
+	}
+	if (y0 == span.y) {
+	    if (x0 < span.x0) span.x0 = x0;
+	    else span.x1 = x0 + 1;
+	    continue;
+	}
+	spans.push_back(span);
+	span = {y0, x0, x0 + 1};
+    }
+    spans.push_back(span);
+}
+
+bool clip_line(float& x0, float& y0, float& x1, float& y1, float x_min, float y_min, float x_max, float y_max) {
+    float dx = x1 - x0;
+    float dy = y1 - y0;
+    // Entering and leaving parameter along the segment, p * t <= q for every boundary
+    float t0 = 0.f;
+    float t1 = 1.f;
+    float p[4] = {-dx, dx, -dy, dy};
+    float q[4] = {x0 - x_min, x_max - x0, y0 - y_min, y_max - y0};
+    for (int i = 0; i < 4; i++) {
+	if (p[i] == 0.f) {
+	    // Parallel to this boundary, entirely outside or not limited by it
+	    if (q[i] < 0.f) return false;
+	    continue;
+	}
+	float t = q[i] / p[i];
+	if (p[i] < 0.f) t0 = std::max(t0, t);
+	else t1 = std::min(t1, t);
+	if (t0 > t1) return false;
+    }
+    x1 = x0 + t1 * dx;
+    y1 = y0 + t1 * dy;
+    x0 = x0 + t0 * dx;
+    y0 = y0 + t0 * dy;
+    return true;
+}
+
+// Clips the segment between pixel centers to the canvas and rounds the new ends back to pixels
+static bool clip_to_canvas(int& x0, int& y0, int& x1, int& y1, int width, int height) {
+    float fx0 = x0, fy0 = y0, fx1 = x1, fy1 = y1;
+    if (!clip_line(fx0, fy0, fx1, fy1, 0.f, 0.f, width - 1, height - 1)) return false;
+    x0 = lroundf(fx0);
+    y0 = lroundf(fy0);
+    x1 = lroundf(fx1);
+    y1 = lroundf(fy1);
+    return true;
+}
+
+// [lo, hi] of x where a * x + b lies in [min, max], or an empty range
+static void solve_range(double a, double b, double min, double max, double& lo, double& hi) {
+    if (a == 0.0) {
+	if (b < min || b > max) {
+	    lo = 1.0;
+	    hi = 0.0;
+	}
+	return;
+    }
+    double from = (min - b) / a;
+    double to = (max - b) / a;
+    if (a < 0.0) std::swap(from, to);
+    lo = std::max(lo, from);
+    hi = std::min(hi, to);
+}
+
+void rasterize_thick_line(int x0, int y0, int x1, int y1, int line_width, int width, int height, std::vector<Span>& spans) {
+    line_width = std::clamp(line_width, MIN_LINE_WIDTH, MAX_LINE_WIDTH);
+    if (line_width == 1) {
+	if (clip_to_canvas(x0, y0, x1, y1, width, height)) rasterize_line(x0, y0, x1, y1, spans);
+	return;
+    }
+    double radius = line_width / 2.0;
+    // Only the part of the segment within radius of the canvas reaches canvas pixels, its rows
+    // are the ones visited. The pixels themselves are measured against the exact segment, the
+    // rounding of the clipped ends would move pixels at exactly radius in or out.
+    float fx0 = x0, fy0 = y0, fx1 = x1, fy1 = y1;
+    if (!clip_line(fx0, fy0, fx1, fy1, -radius, -radius, width - 1 + radius, height - 1 + radius)) return;
+    int top = std::max((int)floor(std::min(fy0, fy1) - radius), 0);
+    int bottom = std::min((int)ceil(std::max(fy0, fy1) + radius), height - 1);
+    double ax = x0, ay = y0;
+    double dx = x1 - x0, dy = y1 - y0;
+    double length = sqrt(dx * dx + dy * dy);
+    for (int y = top; y <= bottom; y++) {
+	double ry = y - ay;
+	// The row crosses a convex shape, its pixels are the widest of the parts that cross it:
+	// the band along the segment and the round caps at both ends
+	double lo = INFINITY;
+	double hi = -INFINITY;
+	if (length > 0.0) {
+	    // Projection onto the segment within [0, length^2], distance from it within radius
+	    double band_lo = -INFINITY;
+	    double band_hi = INFINITY;
+	    solve_range(dx, ry * dy, 0.0, length * length, band_lo, band_hi);
+	    solve_range(-dy, ry * dx, -radius * length, radius * length, band_lo, band_hi);
+	    if (band_lo <= band_hi) {
+		lo = band_lo;
+		hi = band_hi;
+	    }
+	}
+	for (int end = 0; end < 2; end++) {
+	    double cy = ry - end * dy;
+	    if (fabs(cy) > radius) continue;
+	    double half = sqrt(radius * radius - cy * cy);
+	    double cx = end * dx;
+	    lo = std::min(lo, cx - half);
+	    hi = std::max(hi, cx + half);
+	}
+	if (lo > hi) continue;
+	int left = std::max((int)ceil(ax + lo), 0);
+	int right = std::min((int)floor(ax + hi), width - 1);
+	if (left <= right) spans.push_back({y, left, right + 1});
+    }
+}
+
+// Appends pixel x of row y to the run being built, starting a new span when the row changes
+static void aa_pixel(std::vector<Span>& spans, std::vector<u8>& coverage, Span& run, int x, int y, u8 value) {
+    if (run.y != y || x != run.x1) {
+	if (run.x0 < run.x1) spans.push_back(run);
+	run = {y, x, x};
+    }
+    run.x1++;
+    coverage.push_back(value);
+}
+
+void rasterize_line_aa(int x0, int y0, int x1, int y1, int width, int height, std::vector<Span>& spans, std::vector<u8>& coverage) {
+    if (!clip_to_canvas(x0, y0, x1, y1, width, height)) return;
+    bool steep = abs(y1 - y0) > abs(x1 - x0);
+    if (steep) {
+	std::swap(x0, y0);
+	std::swap(x1, y1);
+    }
+    if (x0 > x1) {
+	std::swap(x0, x1);
+	std::swap(y0, y1);
+    }
+    int dx = x1 - x0;
+    int dy = y1 - y0;
+    // Minor axis position in 32.32 fixed point, the top byte of the fraction is the coverage of
+    // the second pixel. Long lines would drift by pixels with 16 fraction bits.
+    const long long one = 1ll << 32;
+    long long gradient = dx == 0 ? 0 : dy * one / dx;
+    long long y = y0 * one;
+    if (!steep) {
+	// Each of the two rails is a staircase, its pixels in one row are consecutive.
+	// Runs are built per rail and flushed when the row changes.
+	Span runs[2] = {{0, 0, 0}, {0, 0, 0}};
+	std::vector<u8> rail_coverage[2];
+	for (int x = x0; x <= x1; x++, y += gradient) {
+	    int row = (int)(y >> 32);
+	    u8 second = (y >> 24) & 0xFF;
+	    for (int rail = 0; rail < 2; rail++) {
+		Span& run = runs[rail];
+		int ry = row + rail;
+		u8 value = rail ? second : 255 - second;
+		if (ry < 0 || ry >= height || value == 0) continue;
+		if (run.y != ry || x != run.x1) {
+		    if (run.x0 < run.x1) {
+			spans.push_back(run);
+			coverage.insert(coverage.end(), rail_coverage[rail].begin(), rail_coverage[rail].end());
+		    }
+		    run = {ry, x, x};
+		    rail_coverage[rail].clear();
+		}
+		run.x1++;
+		rail_coverage[rail].push_back(value);
+	    }
+	}
+	for (int rail = 0; rail < 2; rail++) {
+	    if (runs[rail].x0 < runs[rail].x1) {
+		spans.push_back(runs[rail]);
+		coverage.insert(coverage.end(), rail_coverage[rail].begin(), rail_coverage[rail].end());
+	    }
+	}
+	return;
+    }
+    // Steep lines cover two neighbours in each row
+    Span run = {0, 0, 0};
+    for (int x = x0; x <= x1; x++, y += gradient) {
+	int column = (int)(y >> 32);
+	u8 second = (y >> 24) & 0xFF;
+	if (255 - second > 0 && column >= 0 && column < width) aa_pixel(spans, coverage, run, column, x, 255 - second);
+	if (second > 0 && column + 1 >= 0 && column + 1 < width) aa_pixel(spans, coverage, run, column + 1, x, second);
+    }
+    if (run.x0 < run.x1) spans.push_back(run);
+}
+
+void rasterize_rect(int x0, int y0, int x1, int y1, bool filled, std::vector<Span>& spans) {
+    if (x0 > x1) std::swap(x0, x1);
+    if (y0 > y1) std::swap(y0, y1);
+    for (int y = y0; y <= y1; y++) {
+	if (filled || y == y0 || y == y1 || x1 - x0 < 2) spans.push_back({y, x0, x1 + 1});
+	else {
+	    spans.push_back({y, x0, x0 + 1});
+	    spans.push_back({y, x1, x1 + 1});
+	}
+    }
+}
+
+// Outermost and innermost pixel of the left side of the outline in one row
+struct Ellipse_Row {
+    int outer = INT_MAX;
+    int inner = INT_MIN;
+};
+
+static void ellipse_pixel(std::vector<Ellipse_Row>& rows, int top, int x, int y) {
+    Ellipse_Row& row = rows[y - top];
+    row.outer = std::min(row.outer, x);
+    row.inner = std::max(row.inner, x);
+}
+
+void rasterize_ellipse(int x0, int y0, int x1, int y1, bool filled, std::vector<Span>& spans) {
+    if (x0 > x1) std::swap(x0, x1);
+    if (y0 > y1) std::swap(y0, y1);
+    // The outline is symmetric, only the left side is traced, x on the right is sum - x
+    int sum = x0 + x1;
+    int top = y0;
+    std::vector<Ellipse_Row> rows(y1 - y0 + 1);
+    // Zingl's ellipse in a rectangle, the errors get large, a 64k wide ellipse needs 64 bits
+    long long a = x1 - x0;
+    long long b = y1 - y0;
+    long long b1 = b & 1;
+    long long dx = 4 * (1 - a) * b * b;
+    long long dy = 4 * (b1 + 1) * a * a;
+    long long err = dx + dy + b1 * a * a;
+    int lower = y0 + (b + 1) / 2;
+    int upper = lower - b1;
+    a *= 8 * a;
+    b1 = 8 * b * b;
+    int x = x0;
+    do {
+	ellipse_pixel(rows, top, x, lower);
+	ellipse_pixel(rows, top, x, upper);
+	long long err2 = 2 * err;
+	if (err2 <= dy) {
+	    lower++;
+	    upper--;
+	    err += dy += a;
+	}
+	if (err2 >= dx || 2 * err > dy) {
+	    x++;
+	    err += dx += b1;
+	}
+    } while (x <= sum - x);
+    // Very flat ellipses stop early, finish their tips
+    while (lower - upper <= b) {
+	ellipse_pixel(rows, top, x - 1, lower++);
+	ellipse_pixel(rows, top, x - 1, upper--);
+    }
+    for (int i = 0; i < (int)rows.size(); i++) {
+	const Ellipse_Row& row = rows[i];
+	int y = top + i;
+	if (filled || row.inner >= sum - row.inner - 1) spans.push_back({y, row.outer, sum - row.outer + 1});
+	else {
+	    spans.push_back({y, row.outer, row.inner + 1});
+	    spans.push_back({y, sum - row.inner, sum - row.outer + 1});
+	}
+    }
+}
+
+// Polygon edge from y_top to y_bottom, excluded, x in 32.32 fixed point at the current row
+struct Polygon_Edge {
+    int y_top;
+    int y_bottom;
+    long long x;
+    long long step;
+};
+
+const int EDGE_SHIFT = 32;
+
+void rasterize_polygon(const std::vector<Point>& points, std::vector<Span>& spans) {
+    std::vector<Polygon_Edge> edges;
+    for (size_t i = 0; i < points.size(); i++) {
+	Point a = points[i];
+	Point b = points[(i + 1) % points.size()];
+	// Horizontal edges never cross a row
+	if (a.y == b.y) continue;
+	if (a.y > b.y) std::swap(a, b);
+	// Rounded down so x never passes the exact crossing, the error stays far below a pixel
+	long long dx = (long long)(b.x - a.x) * (1ll << EDGE_SHIFT);
+	long long step = dx / (b.y - a.y);
+	if (dx % (b.y - a.y) < 0) step--;
+	edges.push_back({a.y, b.y, (long long)a.x * (1ll << EDGE_SHIFT), step});
+    }
+    if (edges.empty()) return;
+    std::sort(edges.begin(), edges.end(), [](const Polygon_Edge& a, const Polygon_Edge& b) { return a.y_top < b.y_top; });
+    std::vector<Polygon_Edge> active;
+    size_t next = 0;
+    for (int y = edges[0].y_top; next < edges.size() || !active.empty(); y++) {
+	while (next < edges.size() && edges[next].y_top == y) active.push_back(edges[next++]);
+	active.erase(std::remove_if(active.begin(), active.end(), [y](const Polygon_Edge& edge) { return edge.y_bottom <= y; }),
+		     active.end());
+	// Crossings only swap where edges intersect, insertion sort is close to linear
+	for (size_t i = 1; i < active.size(); i++) {
+	    Polygon_Edge edge = active[i];
+	    size_t j = i;
+	    for (; j > 0 && active[j - 1].x > edge.x; j--) active[j] = active[j - 1];
+	    active[j] = edge;
+	}
+	// Pixel x is inside when left <= x < right, the first center at or after each crossing
+	const long long round_up = (1ll << EDGE_SHIFT) - 1;
+	for (size_t i = 0; i + 1 < active.size(); i += 2) {
+	    int x0 = (int)((active[i].x + round_up) >> EDGE_SHIFT);
+	    int x1 = (int)((active[i + 1].x + round_up) >> EDGE_SHIFT);
+	    if (x0 < x1) spans.push_back({y, x0, x1});
+	}
+	for (Polygon_Edge& edge : active) edge.x += edge.step;
+    }
+}
+
+void line_points(int x0, int y0, int x1, int y1, int step, int& phase, std::vector<Point>& points) {
+    int dx = abs(x1 - x0);
+    int dy = -abs(y1 - y0);
+    int step_x = x0 < x1 ? 1 : -1;
+    int step_y = y0 < y1 ? 1 : -1;
+    int err = dx + dy;
+    while (x0 != x1 || y0 != y1) {
+	int err2 = err * 2;
+	if (err2 >= dy) {
+	    err += dy;
+	    x0 += step_x;
+	}
+	if (err2 <= dx) {
+	    err += dx;
+	    y0 += step_y;
+	}
+	if (++phase < step) continue;
+	phase = 0;
+	points.push_back({x0, y0});
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "canvas.hpp"
+
+struct Point {
+    int x;
+    int y;
+};
+
+// Bresenham line from (x0, y0) to (x1, y1), both ends included.
+// Consecutive pixels on the same row are merged into one span.
+void rasterize_line(int x0, int y0, int x1, int y1, std::vector<Span>& spans);
+
+const int MIN_LINE_WIDTH = 1;
+const int MAX_LINE_WIDTH = 64;
+
+// Clips the segment to the rectangle [x_min, x_max] x [y_min, y_max] with Liang-Barsky.
+// Returns false when no part of it is inside.
+bool clip_line(float& x0, float& y0, float& x1, float& y1, float x_min, float y_min, float x_max, float y_max);
+
+// Line from (x0, y0) to (x1, y1) of the given width, clipped once to a width x height canvas
+// instead of per pixel. Width 1 is the Bresenham line, wider lines are every pixel whose center
+// is within width / 2 of the segment, so the ends are round. Each row of those is one span.
+void rasterize_thick_line(int x0, int y0, int x1, int y1, int line_width, int width, int height, std::vector<Span>& spans);
+
+// Xiaolin Wu's anti-aliased line, clipped once to a width x height canvas. Every step along
+// the major axis covers two pixels whose coverage adds up to 255. The pixels come out as runs,
+// coverage holds 255 based coverage for the pixels of all spans in order.
+void rasterize_line_aa(int x0, int y0, int x1, int y1, int width, int height, std::vector<Span>& spans, std::vector<u8>& coverage);
+
+// Rectangle with corners (x0, y0) and (x1, y1), both included. The outline is one pixel wide.
+void rasterize_rect(int x0, int y0, int x1, int y1, bool filled, std::vector<Span>& spans);
+
+// Ellipse inscribed in the rectangle with corners (x0, y0) and (x1, y1), traced with an integer
+// midpoint algorithm that also handles even diameters. Each row becomes one span when filled,
+// else the pixels of the outline on each side, merged where the sides meet.
+void rasterize_ellipse(int x0, int y0, int x1, int y1, bool filled, std::vector<Span>& spans);
+
+// Inside of the closed polygon through points by the even-odd rule: the pixels whose centers
+// lie inside, the points being pixel centers. Scanline fill with an active edge table, the
+// edges crossing a row are kept sorted by x and every pair of crossings becomes one span.
+void rasterize_polygon(const std::vector<Point>& points, std::vector<Span>& spans);
+
+// Every step-th pixel of the Bresenham line from (x0, y0) to (x1, y1), the start left out.
+// phase counts the pixels walked since the last point and carries over between calls, so
+// consecutive segments of a stroke stay evenly spaced.
+void line_points(int x0, int y0, int x1, int y1, int step, int& phase, std::vector<Point>& points);
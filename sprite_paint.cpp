@@ -1,6 +1,12 @@
 #include "ui.hpp"
 #include "includes/raymath.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <iostream>
+#include <thread>
 
 struct Mouse_Data {
     Vector2 position;
@@ -16,6 +22,11 @@ struct App {
     Mouse_Data mouse;
     const char* name = "Sprite Paint";
     float fps = 60;
+    // Skip drawing frames in which nothing changed
+    bool on_demand = true;
+    bool focused = true;
+    u64 frames_drawn = 0;
+    u64 frames_skipped = 0;
     void draw() {
 	sprite_window.draw(mouse.position);
 	ui.draw();
@@ -37,6 +48,77 @@ void check_slider(Slider& slider, Vector2 mouse_pos) {
     }
 }
 
+// True when this frame's input could change what is on screen
+bool has_input(App& app) {
+    Vector2 mouse_delta = GetMouseDelta();
+    if (mouse_delta.x != 0.f || mouse_delta.y != 0.f) return true;
+    if (GetMouseWheelMove() != 0.f) return true;
+    for (int button = MOUSE_BUTTON_LEFT; button <= MOUSE_BUTTON_BACK; button++) {
+	if (IsMouseButtonPressed(button) || IsMouseButtonReleased(button)) return true;
+    }
+    bool key_pressed = false;
+    while (GetKeyPressed() != 0) key_pressed = true;
+    // The window may need repainting after being covered or restored
+    bool focused = IsWindowFocused();
+    bool focus_changed = focused != app.focused;
+    app.focused = focused;
+    return key_pressed || focus_changed || IsWindowResized();
+}
+
+// N adds a layer on top, Page Up/Down select, V toggles visibility,
+// comma/period lower/raise opacity and M cycles the blend mode of the active layer
+void layer_controls(Editor& editor) {
+    if (IsKeyPressed(KEY_N)) editor.add_layer();
+    if (IsKeyPressed(KEY_PAGE_UP)) editor.select_layer(editor.active + 1);
+    if (IsKeyPressed(KEY_PAGE_DOWN)) editor.select_layer(editor.active - 1);
+    Layer& layer = editor.active_layer();
+    if (IsKeyPressed(KEY_V)) editor.set_visible(!layer.visible);
+    if (IsKeyPressed(KEY_COMMA)) editor.set_opacity(Clamp(layer.opacity - 16, 0, 255));
+    if (IsKeyPressed(KEY_PERIOD)) editor.set_opacity(Clamp(layer.opacity + 16, 0, 255));
+    if (IsKeyPressed(KEY_M)) editor.set_blend((Blend_Mode)((layer.blend + 1) % BLEND_MODE_MAX));
+}
+
+// Edits since the last clean exit are journaled here for crash recovery
+const char* JOURNAL_PATH = "img/sprite_paint.journal";
+
+// Custom brush stamps are loaded from here when B cycles to them
+const char* BRUSH_STAMP_PATH = "img/brush.png";
+
+void brush_controls(Sprite_Window& sprite, UI& ui) {
+    Brush& brush = sprite.editor.brush;
+    // Steps of an eighth so big brushes don't take forever to resize
+    int step = std::max(1, brush.size / 8);
+    if (IsKeyPressed(KEY_LEFT_BRACKET)) brush.set_size(brush.size - step);
+    if (IsKeyPressed(KEY_RIGHT_BRACKET)) brush.set_size(brush.size + step);
+    if (IsKeyPressed(KEY_E)) brush.mode = (Brush_Mode)((brush.mode + 1) % BRUSH_MODE_MAX);
+    if (IsKeyPressed(KEY_H)) brush.set_hardness(brush.hardness > 0.f ? brush.hardness - 0.25f : 1.f);
+    if (IsKeyPressed(KEY_B)) {
+	Brush_Shape shape = (Brush_Shape)((brush.shape + 1) % BRUSH_SHAPE_MAX);
+	if (shape == BRUSH_CUSTOM) {
+	    if (sprite.load_brush(BRUSH_STAMP_PATH)) return;
+	    ui.set_status(TextFormat("No brush stamp at %s", BRUSH_STAMP_PATH));
+	    shape = BRUSH_SQUARE;
+	}
+	brush.set_shape(shape);
+    }
+}
+
+// Largest euclidean RGBA distance
+const int MAX_FILL_TOLERANCE = 510;
+
+void line_controls(Editor& editor) {
+    if (IsKeyPressed(KEY_LEFT_BRACKET)) editor.line_width = std::max(editor.line_width - 1, MIN_LINE_WIDTH);
+    if (IsKeyPressed(KEY_RIGHT_BRACKET)) editor.line_width = std::min(editor.line_width + 1, MAX_LINE_WIDTH);
+    if (IsKeyPressed(KEY_A)) editor.line_aa = !editor.line_aa;
+}
+
+void fill_controls(Flood_Fill& flood_fill) {
+    if (IsKeyPressed(KEY_MINUS)) flood_fill.tolerance = std::max(flood_fill.tolerance - 4, 0);
+    if (IsKeyPressed(KEY_EQUAL)) flood_fill.tolerance = std::min(flood_fill.tolerance + 4, MAX_FILL_TOLERANCE);
+    if (IsKeyPressed(KEY_T)) flood_fill.metric = (Color_Metric)((flood_fill.metric + 1) % METRIC_MAX);
+    if (IsKeyPressed(KEY_P)) flood_fill.parallel = !flood_fill.parallel;
+}
+
 void controls(App& app) {
     app.mouse.position = GetMousePosition();
     Sprite_Window& sprite = app.sprite_window;
@@ -44,19 +126,70 @@ void controls(App& app) {
     if (CheckCollisionPointRec(app.mouse.position, sprite.boundary)) {
 	if (IsMouseButtonPressed(MOUSE_BUTTON_LEFT)) {
 	    if (sprite.mode == DRAW) {
-		sprite.set_pixel(sprite.point_to_pixel(app.mouse.position), sprite.draw_color);
+		sprite.begin_stroke(sprite.viewport.to_pixel(app.mouse.position));
 	    }
-	    else if (sprite.mode == LINE) {
-		app.mouse.last_click = sprite.point_to_pixel(app.mouse.position);
+	    else if (is_drag_mode(sprite.mode)) {
+		app.mouse.last_click = sprite.viewport.to_pixel(app.mouse.position);
+		if (sprite.is_point_inside(app.mouse.last_click)) sprite.begin_line(app.mouse.last_click);
 	    }
 	    else if (sprite.mode == FILL) {
-		Vector2 cell = sprite.point_to_pixel(app.mouse.position);
+		Vector2 cell = sprite.viewport.to_pixel(app.mouse.position);
 		sprite.fill_region(cell);
 	    }
+	    else if (sprite.mode == REPLACE) {
+		sprite.replace_color(sprite.viewport.to_pixel(app.mouse.position));
+	    }
 	}
     }
+    if (CheckCollisionPointRec(app.mouse.position, sprite.boundary)) {
+	float wheel = GetMouseWheelMove();
+	if (wheel != 0.f) sprite.viewport.zoom_at(app.mouse.position, wheel > 0.f ? 1 : -1);
+    }
+    if (IsMouseButtonDown(MOUSE_BUTTON_MIDDLE)) {
+	sprite.viewport.pan = Vector2Add(sprite.viewport.pan, GetMouseDelta());
+    }
+    if (IsKeyPressed(KEY_HOME)) {
+	sprite.viewport.fit(sprite.boundary, sprite.editor.composite.width, sprite.editor.composite.height);
+    }
+    // One sample per frame, the stroke joins it to the previous one however far the mouse moved
+    if (sprite.editor.stroking) {
+	sprite.stroke_to(sprite.viewport.to_pixel(app.mouse.position));
+	if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT)) sprite.end_stroke();
+    }
+    if (sprite.line_dragging && sprite.mode == POLYGON) {
+	sprite.polygon_to(sprite.viewport.to_pixel(app.mouse.position));
+    }
+    if (sprite.line_dragging && IsMouseButtonReleased(MOUSE_BUTTON_LEFT)) {
+	sprite.end_line();
+    }
+    if (IsKeyDown(KEY_LEFT_CONTROL) || IsKeyDown(KEY_RIGHT_CONTROL)) {
+	if (IsKeyPressed(KEY_Z)) sprite.editor.undo();
+	if (IsKeyPressed(KEY_Y)) sprite.editor.redo();
+	// The branch the next redo takes, after an undo back to where edits went different ways
+	if (IsKeyPressed(KEY_LEFT)) sprite.editor.select_branch(-1);
+	if (IsKeyPressed(KEY_RIGHT)) sprite.editor.select_branch(1);
+    }
+    layer_controls(sprite.editor);
+    if (IsKeyPressed(KEY_X)) {
+	Mirror& mirror = sprite.editor.mirror;
+	mirror.symmetry = (Symmetry)((mirror.symmetry + 1) % SYMMETRY_MAX);
+    }
+    // The bracket keys size the line in line mode and the brush otherwise
+    if (sprite.mode == LINE) line_controls(sprite.editor);
+    else brush_controls(sprite, ui);
+    fill_controls(sprite.editor.flood_fill);
     if (IsKeyPressed(KEY_S)) {
-	ExportImage(sprite.sprite_img, TextFormat("img/%s", sprite.sprite_name));
+	const char* path = TextFormat("img/%s", sprite.sprite_name);
+	if (sprite.save(path)) ui.set_status(TextFormat("Saving %s", path));
+	else ui.set_status("Still saving, try again");
+    }
+    if (sprite.export_job.poll()) {
+	const char* path = sprite.export_job.last_path.c_str();
+	if (sprite.export_job.last_success) {
+	    ui.set_status(TextFormat("Saved %s", path));
+	    sprite.editor.journal_saved(sprite.export_job.last_hash, sprite.export_job.last_opaque);
+	}
+	else ui.set_status(TextFormat("Failed to save %s", path));
     }                         
     check_slider(ui.color_picker.r, app.mouse.position);
     check_slider(ui.color_picker.g, app.mouse.position);
@@ -83,7 +216,7 @@ void controls(App& app) {
 
 }
 
-App init(float width, float height, const char* title) {
+App init(float width, float height, const char* title, int sprite_width, int sprite_height) {
     float fps = 60.f;
     InitWindow(width, height, title);
     SetTargetFPS(fps);
@@ -91,23 +224,89 @@ App init(float width, float height, const char* title) {
     Sprite_Window app_sprite_window; 
     UI app_ui;
     app_ui.init(Layout(app_layout.get_slot(1), 5, true));
-    app_sprite_window.init(app_layout.get_slot(0), BLACK);
+    app_sprite_window.init(app_layout.get_slot(0), BLACK, sprite_width, sprite_height, JOURNAL_PATH);
     App app = { .screen_width = width, 	.screen_height = height, .layout = app_layout, 
 	.sprite_window = app_sprite_window, .ui = app_ui, .mouse = {0}, .name = title, .fps = fps};
     return app;
 }
 
-int main() {
+int main(int argc, char** argv) {
     std::cout << "after app creation\n";
-    App app = init(1000, 1000, "sprite paint");
+    bool on_demand = true;
+    int sprite_width = 64;
+    int sprite_height = 64;
+    for (int i = 1; i < argc; i++) {
+	if (strcmp(argv[i], "--always-redraw") == 0) on_demand = false;
+	else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+	    if (sscanf(argv[++i], "%dx%d", &sprite_width, &sprite_height) != 2) {
+		std::cout << "--size expects WIDTHxHEIGHT, e.g. --size 64x64\n";
+		return 1;
+	    }
+	}
+    }
+    App app = init(1000, 1000, "sprite paint", sprite_width, sprite_height);
+    app.on_demand = on_demand;
+    if (app.sprite_window.recovered_records > 0) {
+	app.ui.set_status(TextFormat("Recovered %llu journal records%s", (unsigned long long)app.sprite_window.recovered_records,
+				     app.sprite_window.recovered_from_save ? " since the last save" : ""));
+    }
+    double start_time = GetTime();
+    std::clock_t start_cpu = std::clock();
+    std::vector<u64> branches;
     while(!WindowShouldClose()) {
+	bool changed = has_input(app);
 	controls(app);
+	app.sprite_window.editor.journal.flush();
+	changed |= app.sprite_window.flush();
+	changed |= app.sprite_window.update_labels();
+	changed |= app.ui.animating();
+	if (app.on_demand && !changed) {
+	    // EndDrawing would swap, wait and poll, only the last two are needed
+	    app.frames_skipped++;
+	    std::this_thread::sleep_for(std::chrono::duration<double>(1.0 / app.fps));
+	    PollInputEvents();
+	    continue;
+	}
+	app.frames_drawn++;
+	Editor& editor = app.sprite_window.editor;
+	Layer& layer = editor.active_layer();
+	const Brush& brush = editor.brush;
+	const char* tool = "";
+	if (app.sprite_window.mode == DRAW) {
+	    tool = TextFormat("Brush %s %d %s", brush_shape_as_string(brush.shape), brush.size, brush_mode_as_string(brush.mode));
+	}
+	else if (app.sprite_window.mode == LINE) {
+	    tool = TextFormat("Width %d%s", editor.line_width, editor.line_aa && editor.line_width == 1 ? " anti-aliased" : "");
+	}
+	else if (app.sprite_window.mode == FILL) {
+	    tool = TextFormat("Tolerance %d %s%s", editor.flood_fill.tolerance, color_metric_as_string(editor.flood_fill.metric),
+			      editor.flood_fill.parallel ? " parallel" : "");
+	}
+	// TextFormat cycles through a few buffers, so tool is still intact here
+	const char* symmetry = editor.mirror.symmetry == SYMMETRY_NONE ? "" : symmetry_as_string(editor.mirror.symmetry);
+	editor.history.branches(branches);
+	const char* branch = "";
+	if (branches.size() > 1) {
+	    size_t at = std::find(branches.begin(), branches.end(), editor.history.redo_target()) - branches.begin();
+	    branch = TextFormat("  Branch %d/%d", (int)at + 1, (int)branches.size());
+	}
+	app.ui.info = TextFormat("Layer %d/%d %s %d%%%s  %s%s%s%s", editor.active + 1, (int)editor.layers.size(),
+				 blend_mode_as_string(layer.blend), layer.opacity * 100 / 255, layer.visible ? "" : " hidden", tool,
+				 *symmetry ? "  Mirror " : "", symmetry, branch);
 	BeginDrawing();
 	ClearBackground(BLACK);
 	app.draw();
 	app.ui.frame_update();
 	EndDrawing();
     }
+    double seconds = GetTime() - start_time;
+    double cpu_seconds = (double)(std::clock() - start_cpu) / CLOCKS_PER_SEC;
+    std::cout << "frames drawn: " << app.frames_drawn << ", skipped: " << app.frames_skipped
+	      << ", cpu usage: " << cpu_seconds / seconds * 100.0 << "% of one core\n";
+    app.sprite_window.export_job.wait();
+    app.sprite_window.editor.labels.wait();
+    // Unsaved edits are given up on a clean exit, like before there was a journal
+    app.sprite_window.editor.journal.discard();
     CloseWindow();
     return 0;
 }
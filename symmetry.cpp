@@ -0,0 +1,123 @@
+#include "symmetry.hpp"
+#include <algorithm>
+
+const char* symmetry_as_string(Symmetry symmetry) {
+    switch (symmetry) {
+    case SYMMETRY_NONE:
+	return "None";
+    case SYMMETRY_HORIZONTAL:
+	return "Horizontal";
+    case SYMMETRY_VERTICAL:
+	return "Vertical";
+    case SYMMETRY_QUAD:
+	return "Quad";
+    case SYMMETRY_RADIAL:
+	return "Radial";
+    case SYMMETRY_MAX:
+	assert(0);
+    }
+    assert(0);
+    return "";
+}
+
+const int MIRROR_X = 1;
+const int MIRROR_Y = 2;
+const int TRANSPOSE = 4;
+
+int Mirror::image_count() const {
+    switch (symmetry) {
+    case SYMMETRY_NONE:
+	return 1;
+    case SYMMETRY_HORIZONTAL:
+    case SYMMETRY_VERTICAL:
+	return 2;
+    case SYMMETRY_QUAD:
+	return 4;
+    case SYMMETRY_RADIAL:
+	return 8;
+    case SYMMETRY_MAX:
+	assert(0);
+    }
+    return 1;
+}
+
+int Mirror::image(int i) const {
+    // Vertical only has the original and the top and bottom mirror
+    if (symmetry == SYMMETRY_VERTICAL) return i * MIRROR_Y;
+    return i;
+}
+
+Point Mirror::transform(int image, int x, int y, int box_width, int box_height) const {
+    if (image & TRANSPOSE) {
+	// About the center: x - (width - 1) / 2 becomes y - (height - 1) / 2 and back
+	int offset = (width - height) / 2;
+	int tx = y + offset;
+	int ty = x - offset;
+	x = tx;
+	y = ty;
+	std::swap(box_width, box_height);
+    }
+    if (image & MIRROR_X) x = width - x - box_width;
+    if (image & MIRROR_Y) y = height - y - box_height;
+    return {x, y};
+}
+
+void Mirror::mirror_spans(std::vector<Span>& spans, size_t first) {
+    size_t last = spans.size();
+    if (symmetry == SYMMETRY_NONE || first == last) return;
+    // The transposed original, the diagonal images mirror it like the others mirror the original
+    if (symmetry == SYMMETRY_RADIAL) transpose_spans(spans, first, last);
+    size_t transposed = spans.size();
+    for (int i = 1; i < image_count(); i++) {
+	int image = this->image(i);
+	size_t from = image & TRANSPOSE ? last : first;
+	size_t to = image & TRANSPOSE ? transposed : last;
+	// Images 4 and up are the transposed spans themselves and their mirrors
+	if (image == TRANSPOSE) continue;
+	for (size_t s = from; s < to; s++) {
+	    Span span = spans[s];
+	    if (image & MIRROR_X) span = {span.y, width - span.x1, width - span.x0};
+	    if (image & MIRROR_Y) span.y = height - 1 - span.y;
+	    spans.push_back(span);
+	}
+    }
+}
+
+void Mirror::transpose_spans(std::vector<Span>& spans, size_t first, size_t last) {
+    // Rows of the transposed spans are columns of the original. Walking the original rows in
+    // order, each column keeps the run of rows it is covered in, a run ends at the first row
+    // the column is missing from and becomes one transposed span.
+    sorted.assign(spans.begin() + first, spans.begin() + last);
+    std::sort(sorted.begin(), sorted.end(), [](const Span& a, const Span& b) { return a.y < b.y; });
+    int min_x = sorted[0].x0;
+    int max_x = sorted[0].x1;
+    for (const Span& span : sorted) {
+	min_x = std::min(min_x, span.x0);
+	max_x = std::max(max_x, span.x1);
+    }
+    int offset = (width - height) / 2;
+    auto emit = [&](int x, int start, int end) {
+	// Column x, rows [start, end]
+	spans.push_back({x - offset, start + offset, end + offset + 1});
+    };
+    run_start.assign(max_x - min_x, 0);
+    // Last row each column was covered in, one before the first row when it hasn't been
+    int none = sorted[0].y - 2;
+    run_end.assign(max_x - min_x, none);
+    for (const Span& span : sorted) {
+	for (int x = span.x0; x < span.x1; x++) {
+	    int column = x - min_x;
+	    int& end = run_end[column];
+	    // Overlapping spans cover the same pixel twice
+	    if (end == span.y) continue;
+	    if (end != span.y - 1) {
+		if (end != none) emit(x, run_start[column], end);
+		run_start[column] = span.y;
+	    }
+	    end = span.y;
+	}
+    }
+    for (int column = 0; column < max_x - min_x; column++) {
+	if (run_end[column] != none) emit(min_x + column, run_start[column], run_end[column]);
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "raster.hpp"
+
+// Copies every edit mirrors onto the canvas, about the canvas center. Horizontal mirrors left
+// and right, vertical top and bottom, quad both. Radial adds the two diagonals for 8 copies,
+// turning by other angles wouldn't map pixels onto pixels.
+enum Symmetry {
+    SYMMETRY_NONE, SYMMETRY_HORIZONTAL, SYMMETRY_VERTICAL, SYMMETRY_QUAD, SYMMETRY_RADIAL, SYMMETRY_MAX
+};
+
+const char* symmetry_as_string(Symmetry symmetry);
+
+// The images of a symmetry on a width x height canvas. Image i mirrors across the main diagonal
+// when bit 2 is set, then left and right when bit 0 is set, then top and bottom when bit 1 is.
+// Image 0 is the original. On canvases that aren't square the diagonals go through the center
+// rounded to a pixel, when width and height differ in parity the copies are half a pixel off.
+struct Mirror {
+    Symmetry symmetry = SYMMETRY_NONE;
+    int width = 0;
+    int height = 0;
+    // Column runs of the spans being transposed, kept so repeated calls don't allocate
+    std::vector<int> run_start;
+    std::vector<int> run_end;
+    std::vector<Span> sorted;
+    int image_count() const;
+    // The image number of the i-th image of this symmetry
+    int image(int i) const;
+    // Top left corner of the box_width x box_height box at (x, y) in image. Transposed boxes
+    // are box_height x box_width.
+    Point transform(int image, int x, int y, int box_width = 1, int box_height = 1) const;
+    // Appends every image but the original of spans[first, end)
+    void mirror_spans(std::vector<Span>& spans, size_t first = 0);
+    // Appends the spans of the pixels of spans[first, end) mirrored across the main diagonal
+    void transpose_spans(std::vector<Span>& spans, size_t first, size_t last);
+};
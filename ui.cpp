@@ -1,5 +1,10 @@
 #include "ui.hpp"
 #include "includes/raymath.h"
+
+const double STATUS_SECONDS = 3.0;
+const float ZOOM_LEVELS[] = {1.f / 16.f, 1.f / 8.f, 1.f / 4.f, 1.f / 2.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 8.f,
+    10.f, 12.f, 16.f, 20.f, 24.f, 32.f, 40.f, 48.f, 64.f};
+const int ZOOM_LEVEL_COUNT = sizeof(ZOOM_LEVELS) / sizeof(ZOOM_LEVELS[0]);
 void Button::draw() const {
     Rectangle rec = down ? squish_rec(boundary, 5.f) : boundary;
     Color contrast_col = reverse_brightness(color);
@@ -77,6 +82,8 @@ void UI::init(Layout layout) {
     buttons[1].boundary = layout.get_slot(2); 
     // should be bound to draw mode directly instead!!
     buttons[1].text = "Draw";
+    info_rec = layout.get_slot(3);
+    status_rec = layout.get_slot(4);
 }
   
 void UI::frame_update() {
@@ -92,96 +99,410 @@ void UI::draw() {
     for (const Button& button : buttons) {
 	button.draw();
     }
+    float font_size = 20.f;
+    DrawText(info.c_str(), info_rec.x + font_size, info_rec.y + info_rec.height / 2.f - font_size / 2.f, font_size, WHITE);
+    // Status messages fade out after a few seconds
+    float status_alpha = Clamp(STATUS_SECONDS - (GetTime() - status_time), 0.f, 1.f);
+    if (status_alpha > 0.f) {
+	DrawText(status.c_str(), status_rec.x + font_size, status_rec.y + status_rec.height / 2.f - font_size / 2.f, font_size, Fade(WHITE, status_alpha));
+    }
 }
-void Sprite_Window::set_pixel(Vector2 pos, Color color) {
-    ImageDrawPixel(&sprite_img, pos.x, pos.y, color);
-    UpdateTexture(tex, sprite_img.data);
+// Keeps going a little past the fade so the last frame drawn has the message gone
+bool UI::animating() const {
+    return !status.empty() && GetTime() - status_time < STATUS_SECONDS + 0.1;
 }
-Vector2 Sprite_Window::point_to_pixel(Vector2 point) {
-    point = Vector2Divide(point, {boundary.width, boundary.height});	
-    point = Vector2Multiply(point, {(float)sprite_img.width, (float)sprite_img.height});
-    point = {floor(point.x), floor(point.y)};
-    return point; 
+void UI::set_status(const char* text) {
+    status = text;
+    status_time = GetTime();
+}
+bool Export_Job::start(const Canvas& canvas, const char* path) {
+    if (busy()) return false;
+    state = std::make_shared<Export_State>();
+    state->path = path;
+    // Only the pixels are needed, a single copy of the tile buffer
+    state->snapshot.width = canvas.width;
+    state->snapshot.height = canvas.height;
+    state->snapshot.tiles_x = canvas.tiles_x;
+    state->snapshot.tiles_y = canvas.tiles_y;
+    state->snapshot.pixels = canvas.pixels;
+    Export_State* job = state.get();
+    job->thread = std::thread([job]() {
+	const Canvas& snapshot = job->snapshot;
+	std::vector<u32> pixels((u64)snapshot.width * snapshot.height);
+	snapshot.copy_to_linear(pixels.data());
+	// Opaque pixels are the same premultiplied or not
+	job->hash = journal_hash(pixels.data(), pixels.size(), job->opaque);
+	unpremultiply_span(pixels.data(), pixels.data(), pixels.size());
+	Image img = {pixels.data(), snapshot.width, snapshot.height, 1, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+	job->success = ExportImage(img, job->path.c_str());
+	job->finished = true;
+    });
+    return true;
+}
+bool Export_Job::poll() {
+    if (!busy() || !state->finished) return false;
+    state->thread.join();
+    last_success = state->success;
+    last_path = state->path;
+    last_hash = state->hash;
+    last_opaque = state->opaque;
+    state.reset();
+    return true;
+}
+void Export_Job::wait() {
+    if (!busy()) return;
+    state->thread.join();
+    state->finished = true;
+    last_success = state->success;
+    last_path = state->path;
+    last_hash = state->hash;
+    last_opaque = state->opaque;
+    state.reset();
+}
+float Viewport::scale() const {
+    return ZOOM_LEVELS[zoom_level];
+}
+Vector2 Viewport::to_pixel(Vector2 point) const {
+    point = Vector2Scale(Vector2Subtract(point, pan), 1.f / scale());
+    return {floorf(point.x), floorf(point.y)};
+}
+Rectangle Viewport::to_screen(float x, float y, float width, float height) const {
+    return {pan.x + x * scale(), pan.y + y * scale(), width * scale(), height * scale()};
+}
+void Viewport::zoom_at(Vector2 point, int steps) {
+    Vector2 canvas_point = Vector2Scale(Vector2Subtract(point, pan), 1.f / scale());
+    zoom_level = Clamp(zoom_level + steps, 0, ZOOM_LEVEL_COUNT - 1);
+    pan = Vector2Subtract(point, Vector2Scale(canvas_point, scale()));
+    // Whole screen pixels keep the canvas pixels crisp
+    pan = {roundf(pan.x), roundf(pan.y)};
+}
+void Viewport::fit(Rectangle boundary, int width, int height) {
+    zoom_level = 0;
+    for (int level = 0; level < ZOOM_LEVEL_COUNT; level++) {
+	if (width * ZOOM_LEVELS[level] <= boundary.width && height * ZOOM_LEVELS[level] <= boundary.height) zoom_level = level;
+    }
+    pan.x = roundf(boundary.x + (boundary.width - width * scale()) / 2.f);
+    pan.y = roundf(boundary.y + (boundary.height - height * scale()) / 2.f);
+}
+void Sprite_Window::begin_stroke(Vector2 cell) {
+    if (!is_point_inside(cell)) return;
+    editor.begin_stroke(cell.x, cell.y, color_to_pixel(draw_color));
+}
+// Samples may leave the canvas, the segments are clipped when they are written
+void Sprite_Window::stroke_to(Vector2 cell) {
+    editor.stroke_to(cell.x, cell.y);
+}
+void Sprite_Window::end_stroke() {
+    editor.end_stroke();
 }
-
 bool Sprite_Window::is_point_inside(Vector2 point) {
-    return point.x < sprite_img.width && point.y < sprite_img.height && point.x >= 0.f && point.y >= 0.f;
+    return point.x < editor.composite.width && point.y < editor.composite.height && point.x >= 0.f && point.y >= 0.f;
 }
 
 void Sprite_Window::fill_region(Vector2 point) {
-    Color empty = GetImageColor(sprite_img, point.x, point.y);
-    if (ColorIsEqual(empty, draw_color)) return;
-    ImageDrawPixel(&sprite_img, point.x, point.y, draw_color);
-    Vector2 new_point = {point.x + 1, point.y};
-    Color new_color; 
-    if (is_point_inside(new_point)) {
-	new_color = GetImageColor(sprite_img, new_point.x, new_point.y);
-	if (ColorIsEqual(empty, new_color)) fill_region(new_point);
-    }
-    new_point = {point.x - 1, point.y};
-    if (is_point_inside(new_point)) {
-	new_color = GetImageColor(sprite_img, new_point.x, new_point.y);
-	if (ColorIsEqual(empty, new_color)) fill_region(new_point);
-    }
-    new_point = {point.x, point.y + 1};
-    if (is_point_inside(new_point)) {
-	new_color = GetImageColor(sprite_img, new_point.x, new_point.y);
-	if (ColorIsEqual(empty, new_color)) fill_region(new_point);
-    }
-    new_point = {point.x, point.y - 1};
-    if (is_point_inside(new_point)) {
-	new_color = GetImageColor(sprite_img, new_point.x, new_point.y);
-	if (ColorIsEqual(empty, new_color)) fill_region(new_point);
-    }
+    if (!is_point_inside(point)) return;
+    editor.fill(point.x, point.y, color_to_pixel(draw_color));
+}
+void Sprite_Window::replace_color(Vector2 point) {
+    if (!is_point_inside(point)) return;
+    editor.replace_color(editor.canvas().get(point.x, point.y), color_to_pixel(draw_color));
 }
 void Sprite_Window::draw(Vector2 mouse_position) {
+    BeginScissorMode(boundary.x, boundary.y, boundary.width, boundary.height);
     switch (mode) {
     case DRAW:
 	draw_preview(mouse_position);
 	break;
     case LINE:
+    case RECT:
+    case FILLED_RECT:
+    case ELLIPSE:
+    case FILLED_ELLIPSE:
+    case POLYGON:
 	if (!line_dragging) draw_preview(mouse_position);
 	else draw_preview_line(mouse_position); 
 	break;
     case FILL:
+    case REPLACE:
 	draw_preview(mouse_position);
 	break;
     case MOUSE_MODE_MAX:
       break;
     }
+    EndScissorMode();
 }
 void Sprite_Window::draw_preview(Vector2 mouse_position) {
     if (!line_dragging) {
-	DrawTexturePro(tex, {0.f, 0.f, (float)tex.width, (float)tex.height}, boundary, {0.f, 0.f}, 0.f, WHITE);
+	draw_canvas();
 	if (CheckCollisionPointRec(mouse_position, boundary)) {
-	    float cell_size = boundary.width / tex.width;
-	    Vector2 new_pos = point_to_pixel(mouse_position);
-	    DrawRectangle(new_pos.x * cell_size, new_pos.y * cell_size, cell_size, cell_size, draw_color);
+	    Vector2 new_pos = viewport.to_pixel(mouse_position);
+	    int size = editor.brush.size;
+	    if (mode == FILL && is_point_inside(new_pos)) draw_preview_fill(new_pos);
+	    // Bigger brushes get an outline of the area a stamp covers
+	    if (mode == DRAW && size > 1) {
+		float half = size / 2;
+		DrawRectangleLinesEx(viewport.to_screen(new_pos.x - half, new_pos.y - half, size, size), 1.f, draw_color);
+	    }
+	    else DrawRectangleRec(viewport.to_screen(new_pos.x, new_pos.y, 1.f, 1.f), draw_color);
 	}
 	return;
     }
 }
 
+// Regions with more runs than this only get their bounding box outlined
+const u32 MAX_PREVIEW_RUNS = 4096;
+
+void Sprite_Window::draw_preview_fill(Vector2 cell) {
+    if (hover_dirty || !Vector2Equals(cell, hover_cell) || hover_tolerance != editor.flood_fill.tolerance) {
+	hover_cell = cell;
+	hover_tolerance = editor.flood_fill.tolerance;
+	hover_dirty = false;
+	const Region* region = editor.fill_region(cell.x, cell.y);
+	hover_region = region ? region - editor.labels.labels.regions.data() : -1;
+    }
+    if (hover_region < 0) return;
+    const Region_Labels& labels = editor.labels.labels;
+    const Region& region = labels.regions[hover_region];
+    if (region.run_count > MAX_PREVIEW_RUNS) {
+	Rectangle bounds = viewport.to_screen(region.min_x, region.min_y, region.max_x - region.min_x + 1, region.max_y - region.min_y + 1);
+	DrawRectangleLinesEx(bounds, 1.f, draw_color);
+	return;
+    }
+    Color color = Fade(draw_color, 0.5f);
+    for (u32 i = region.first; i < region.first + region.run_count; i++) {
+	const Span& run = labels.runs[i];
+	DrawRectangleRec(viewport.to_screen(run.x0, run.y, run.x1 - run.x0, 1.f), color);
+    }
+}
+
 void Sprite_Window::draw_preview_line(Vector2 mouse_position) {
-    Vector2 last_cell = point_to_pixel(mouse_position);
-    float cell_size = boundary.width / tex.width;
-     if (CheckCollisionPointRec(mouse_position, boundary)) {
-	if (last_cell.x != line_first_cell.x && last_cell.y != line_first_cell.y) {
-	    UnloadImage(preview_img);
-	    preview_img = ImageCopy(sprite_img);
-	    ImageDrawLineV(&preview_img, line_first_cell, last_cell, draw_color);
-	    UpdateTexture(tex, preview_img.data);
+    Vector2 last_cell = viewport.to_pixel(mouse_position);
+    // Only rasterize again when the end point moved to another pixel
+    // Polygon edges are added as the mouse moves, in polygon_to()
+    if (mode != POLYGON && is_point_inside(last_cell) && !Vector2Equals(last_cell, line_last_cell)) {
+	line_last_cell = last_cell;
+	line_spans.clear();
+	rasterize_drag(line_first_cell, last_cell, line_spans);
+    }
+    draw_canvas();
+    if (!line_coverage.empty()) {
+	// One rectangle per pixel, a 1 pixel line only has about two per step
+	const u8* coverage = line_coverage.data();
+	for (const Span& span : line_spans) {
+	    for (int x = span.x0; x < span.x1; x++) {
+		DrawRectangleRec(viewport.to_screen(x, span.y, 1.f, 1.f), Fade(draw_color, *coverage++ / 255.f));
+	    }
+	}
+    }
+    else {
+	for (const Span& span : line_spans) {
+	    DrawRectangleRec(viewport.to_screen(span.x0, span.y, span.x1 - span.x0, 1.f), draw_color);
+	}
+    }
+    for (const Span& span : closing_spans) {
+	DrawRectangleRec(viewport.to_screen(span.x0, span.y, span.x1 - span.x0, 1.f), draw_color);
+    }
+    // Mirror images of anti-aliased lines are previewed without their coverage
+    if (editor.mirror.symmetry != SYMMETRY_NONE) {
+	mirrored_spans.assign(line_spans.begin(), line_spans.end());
+	mirrored_spans.insert(mirrored_spans.end(), closing_spans.begin(), closing_spans.end());
+	size_t count = mirrored_spans.size();
+	editor.mirror.mirror_spans(mirrored_spans);
+	for (size_t i = count; i < mirrored_spans.size(); i++) {
+	    const Span& span = mirrored_spans[i];
+	    DrawRectangleRec(viewport.to_screen(span.x0, span.y, span.x1 - span.x0, 1.f), draw_color);
 	}
     }
-    DrawTexturePro(tex, {0.f, 0.f, (float)tex.width, (float)tex.height}, boundary, {0.f, 0.f}, 0.f, WHITE);
-    DrawRectangle(last_cell.x * cell_size, last_cell.y * cell_size, cell_size, cell_size, MAGENTA);
+    DrawRectangleRec(viewport.to_screen(last_cell.x, last_cell.y, 1.f, 1.f), MAGENTA);
+}
+void Sprite_Window::draw_canvas() {
+    const Canvas& canvas = editor.composite;
+    Rectangle dest = viewport.to_screen(0.f, 0.f, canvas.width, canvas.height);
+    // The composite is premultiplied
+    BeginBlendMode(BLEND_ALPHA_PREMULTIPLY);
+    DrawTexturePro(tex, {0.f, 0.f, (float)canvas.width, (float)canvas.height}, dest, {0.f, 0.f}, 0.f, WHITE);
+    EndBlendMode();
+    DrawRectangleLinesEx(squish_rec(dest, -1.f), 1.f, DARKGRAY);
+    // Mirror axes
+    Symmetry symmetry = editor.mirror.symmetry;
+    Color guide = Fade(GRAY, 0.5f);
+    Vector2 center = {dest.x + dest.width / 2.f, dest.y + dest.height / 2.f};
+    if (symmetry == SYMMETRY_HORIZONTAL || symmetry == SYMMETRY_QUAD || symmetry == SYMMETRY_RADIAL) {
+	DrawLineV({center.x, dest.y}, {center.x, dest.y + dest.height}, guide);
+    }
+    if (symmetry == SYMMETRY_VERTICAL || symmetry == SYMMETRY_QUAD || symmetry == SYMMETRY_RADIAL) {
+	DrawLineV({dest.x, center.y}, {dest.x + dest.width, center.y}, guide);
+    }
+    if (symmetry == SYMMETRY_RADIAL) {
+	float half = std::min(dest.width, dest.height) / 2.f;
+	DrawLineV({center.x - half, center.y - half}, {center.x + half, center.y + half}, guide);
+	DrawLineV({center.x - half, center.y + half}, {center.x + half, center.y - half}, guide);
+    }
+}
+void Sprite_Window::rasterize_drag(Vector2 first, Vector2 last, std::vector<Span>& spans) {
+    line_coverage.clear();
+    switch (mode) {
+    case RECT:
+    case FILLED_RECT:
+	rasterize_rect(first.x, first.y, last.x, last.y, mode == FILLED_RECT, spans);
+	break;
+    case ELLIPSE:
+    case FILLED_ELLIPSE:
+	rasterize_ellipse(first.x, first.y, last.x, last.y, mode == FILLED_ELLIPSE, spans);
+	break;
+    case POLYGON:
+	// Only the first vertex, the edges are added in polygon_to()
+	rasterize_line(first.x, first.y, last.x, last.y, spans);
+	break;
+    default: {
+	// Clipped to the canvas like the line the editor draws
+	const Canvas& canvas = editor.composite;
+	if (editor.line_aa && editor.line_width == 1) {
+	    rasterize_line_aa(first.x, first.y, last.x, last.y, canvas.width, canvas.height, spans, line_coverage);
+	}
+	else rasterize_thick_line(first.x, first.y, last.x, last.y, editor.line_width, canvas.width, canvas.height, spans);
+	break;
+    }
+    }
+}
+void Sprite_Window::begin_line(Vector2 cell) {
+    line_dragging = true;
+    line_first_cell = cell;
+    line_last_cell = cell;
+    line_spans.clear();
+    rasterize_drag(cell, cell, line_spans);
+    polygon_points.assign(1, {(int)cell.x, (int)cell.y});
+    closing_spans.clear();
+}
+void Sprite_Window::polygon_to(Vector2 cell) {
+    Point point = {std::clamp((int)cell.x, 0, editor.composite.width - 1), std::clamp((int)cell.y, 0, editor.composite.height - 1)};
+    Point last = polygon_points.back();
+    if (point.x == last.x && point.y == last.y) return;
+    rasterize_line(last.x, last.y, point.x, point.y, line_spans);
+    polygon_points.push_back(point);
+    line_last_cell = {(float)point.x, (float)point.y};
+    closing_spans.clear();
+    rasterize_line(point.x, point.y, polygon_points[0].x, polygon_points[0].y, closing_spans);
+}
+void Sprite_Window::end_line() {
+    // The preview spans are always those of line_last_cell
+    if (mode == LINE) editor.draw_line(line_first_cell.x, line_first_cell.y, line_last_cell.x, line_last_cell.y, color_to_pixel(draw_color));
+    else {
+	// The outline is kept too, the inside alone leaves out pixels the edges only graze
+	if (mode == POLYGON) {
+	    line_spans.insert(line_spans.end(), closing_spans.begin(), closing_spans.end());
+	    rasterize_polygon(polygon_points, line_spans);
+	    polygon_points.clear();
+	    closing_spans.clear();
+	}
+	editor.draw_spans(line_spans, color_to_pixel(draw_color));
+    }
+    line_spans.clear();
+    line_dragging = false;
+}
+// Composites the layer tiles written since the last call and uploads them,
+// one partial texture update per tile. Called once per frame, before drawing.
+bool Sprite_Window::flush() {
+    total_upload_bytes += frame_upload_bytes;
+    frame_upload_bytes = 0;
+    editor.update_composite();
+    Canvas& canvas = editor.composite;
+    for (int i = 0; i < canvas.tile_count(); i++) {
+	if (!canvas.dirty[i]) continue;
+	float x = (i % canvas.tiles_x) * TILE_SIZE;
+	float y = (i / canvas.tiles_x) * TILE_SIZE;
+	UpdateTextureRec(tex, {x, y, (float)TILE_SIZE, (float)TILE_SIZE}, canvas.tile(i));
+	frame_upload_bytes += TILE_PIXELS * sizeof(u32);
+	canvas.dirty[i] = 0;
+    }
+    if (frame_upload_bytes > 0) hover_dirty = true;
+    return frame_upload_bytes > 0;
+}
+bool Sprite_Window::update_labels() {
+    if (mode != FILL) return false;
+    bool installed = editor.update_labels();
+    if (installed) hover_dirty = true;
+    return installed;
+}
+bool Sprite_Window::save(const char* path) {
+    editor.update_composite();
+    if (!export_job.start(editor.composite, path)) return false;
+    editor.journal_save(path);
+    return true;
+}
+bool Sprite_Window::load_saved(const char* path, int width, int height, std::vector<u32>& pixels) {
+    Image img = LoadImage(path);
+    if (img.data == nullptr) return false;
+    bool fits = img.width == width && img.height == height;
+    if (fits) {
+	ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+	pixels.resize((u64)width * height);
+	memcpy(pixels.data(), img.data, pixels.size() * sizeof(u32));
+    }
+    UnloadImage(img);
+    return fits;
+}
+bool Sprite_Window::open_journal(const char* path) {
+    std::vector<u8> records;
+    u64 valid_bytes = 0;
+    Journal_Plan plan;
+    bool recoverable = read_journal(path, records, valid_bytes) && plan_replay(records, plan) &&
+	plan.init.width >= MIN_SPRITE_SIZE && plan.init.width <= MAX_SPRITE_SIZE &&
+	plan.init.height >= MIN_SPRITE_SIZE && plan.init.height <= MAX_SPRITE_SIZE;
+    if (!recoverable) {
+	if (!editor.journal.open(path, 0)) return false;
+	// Nothing was drawn yet, the canvas is all background
+	Canvas& canvas = editor.canvas();
+	editor.journal.add(JOURNAL_INIT, Journal_Init{canvas.width, canvas.height, canvas.get(0, 0)});
+	return true;
+    }
+    std::vector<u32> saved;
+    if (plan.from_save) {
+	// The save may have been overwritten or edited since, then the journal starts from scratch
+	bool opaque = false;
+	if (!load_saved(plan.save.path, plan.init.width, plan.init.height, saved) ||
+	    journal_hash(saved.data(), saved.size(), opaque) != plan.saved.hash) plan_from_start(plan);
+    }
+    recovered_records = editor.replay(records, plan, plan.from_save ? saved.data() : nullptr);
+    recovered_from_save = plan.from_save;
+    if (!editor.journal.open(path, valid_bytes)) return false;
+    // The journal ends inside a stroke when the app died while drawing, keep what there is of it
+    if (editor.stroking) editor.end_stroke();
+    return true;
+}
+// Dark opaque pixels paint, light or transparent ones don't. Larger images are scaled down
+// to the biggest brush, non-square ones are stretched.
+bool Sprite_Window::load_brush(const char* path) {
+    Image img = LoadImage(path);
+    if (img.data == nullptr) return false;
+    ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+    int size = Clamp(std::max(img.width, img.height), MIN_BRUSH_SIZE, MAX_BRUSH_SIZE);
+    if (img.width != size || img.height != size) ImageResize(&img, size, size);
+    std::vector<u8> coverage(size * size);
+    const Color* pixels = (const Color*)img.data;
+    for (int i = 0; i < size * size; i++) {
+	Color c = pixels[i];
+	u32 luma = (c.r * 77 + c.g * 150 + c.b * 29) >> 8;
+	coverage[i] = c.a * (255 - luma) / 255;
+    }
+    UnloadImage(img);
+    return editor.brush.set_custom(coverage.data(), size);
 }
-void Sprite_Window::init(Rectangle boundary, Color bg_col) {
+void Sprite_Window::init(Rectangle boundary, Color bg_col, int width, int height, const char* journal_path) {
     std::cout << "before sprite window constructor\n";
-    sprite_img = GenImageColor(boundary.width, boundary.height, bg_col);
-    preview_img = GenImageColor(boundary.width, boundary.height, bg_col);
-    undo_img = GenImageColor(boundary.width, boundary.height, bg_col);
+    this->boundary = boundary;
+    width = Clamp(width, MIN_SPRITE_SIZE, MAX_SPRITE_SIZE);
+    height = Clamp(height, MIN_SPRITE_SIZE, MAX_SPRITE_SIZE);
+    editor.init(width, height, color_to_pixel(bg_col));
+    // A recovered sprite keeps the size it had
+    if (!open_journal(journal_path)) std::cout << "can't write the journal at " << journal_path << "\n";
+    width = editor.composite.width;
+    height = editor.composite.height;
+    viewport.fit(boundary, width, height);
     std::cout << "before texture creation\n";
-    tex = LoadTextureFromImage(sprite_img);
+    // The texture covers whole tiles so every tile uploads straight from the canvas
+    Image tex_img = GenImageColor(editor.composite.tiles_x * TILE_SIZE, editor.composite.tiles_y * TILE_SIZE, BLANK);
+    tex = LoadTextureFromImage(tex_img);
+    UnloadImage(tex_img);
     std::cout << "after sprite window constructor\n";
 };
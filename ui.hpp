@@ -1,5 +1,11 @@
 #pragma once
 #include "common.hpp"
+#include "editor.hpp"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 struct Layout {
     bool vertical = true;
@@ -46,31 +52,131 @@ struct Color_Picker {
 struct UI {
     void init(Layout layout);
     Rectangle boundary;
+    Rectangle status_rec = {0};
+    Rectangle info_rec = {0};
+    std::string status;
+    double status_time = 0;
+    // Always shown, describes the active layer
+    std::string info;
     u64 fps = 60;
     Color bg_color = {0x18, 0x18, 0x18, 0xff};
     Color_Picker color_picker = {0};
     Button buttons[2] = {{0}, {0}};
     void frame_update();
     void draw();
+    void set_status(const char* text);
+    bool animating() const;
+};
+
+struct Export_State {
+    std::thread thread;
+    std::atomic<bool> finished{false};
+    bool success = false;
+    std::string path;
+    Canvas snapshot;
+    // Of the pixels written, for the journal
+    u64 hash = 0;
+    bool opaque = false;
+};
+
+// PNG export on a worker thread. The premultiplied composite is copied when the export starts,
+// converting, encoding and writing the file happen off the render thread.
+struct Export_Job {
+    std::shared_ptr<Export_State> state;
+    bool last_success = false;
+    std::string last_path;
+    u64 last_hash = 0;
+    bool last_opaque = false;
+    bool busy() const { return state != nullptr; }
+    // Returns false while another export is still running
+    bool start(const Canvas& canvas, const char* path);
+    // Returns true once after an export finished, last_success and last_path describe it
+    bool poll();
+    void wait();
+};
+
+const int MIN_SPRITE_SIZE = 8;
+const int MAX_SPRITE_SIZE = 16384;
+
+// Maps canvas pixels to the screen. Zoomed in, every canvas pixel covers a whole number
+// of screen pixels, zoomed out it covers a power of two fraction of one.
+struct Viewport {
+    int zoom_level = 0;
+    // Screen position of the canvas origin
+    Vector2 pan = {0, 0};
+    float scale() const;
+    Vector2 to_pixel(Vector2 point) const;
+    Rectangle to_screen(float x, float y, float width, float height) const;
+    // Keeps the canvas point under the given screen point in place
+    void zoom_at(Vector2 point, int steps);
+    // Largest zoom that shows the whole canvas, centered
+    void fit(Rectangle boundary, int width, int height);
 };
 
 struct Sprite_Window {
-    void init(Rectangle boundary, Color bg_col);
-    Image sprite_img = {0};    
-    Image preview_img = {0};
-    Image undo_img = {0};
+    // Recovers the sprite from the journal at journal_path when the last session didn't end
+    // cleanly, else starts a new one there
+    void init(Rectangle boundary, Color bg_col, int width, int height, const char* journal_path);
+    Editor editor;
     Texture tex = {0};
     Rectangle boundary = {0};
+    Viewport viewport;
     Draw_Mode mode = DRAW;
     bool line_dragging = false;
     Vector2 line_first_cell = {-1, -1};
+    Vector2 line_last_cell = {-1, -1};
+    // Pixels of the line or shape being dragged, drawn on top of the texture instead of into the canvas
+    std::vector<Span> line_spans;
+    // Coverage of the pixels of line_spans when the line is anti-aliased, else empty
+    std::vector<u8> line_coverage;
+    // Polygon mode drags a lasso, every cell the mouse passes becomes a vertex. line_spans holds
+    // the edges so far, closing_spans the edge back to the first vertex.
+    std::vector<Point> polygon_points;
+    std::vector<Span> closing_spans;
+    // The drag's spans and their mirror images, for the preview with symmetry on
+    std::vector<Span> mirrored_spans;
     Color draw_color = WHITE;
     const char* sprite_name = "sprite.png";
-    void set_pixel(Vector2 pos, Color color);
-    Vector2 point_to_pixel(Vector2 point);
+    Export_Job export_job;
+    // Region a fill at hover_cell would cover, -1 when the labels don't have it. Looked up again
+    // only when the cursor moves to another pixel, the canvas changes or new labels arrive.
+    Vector2 hover_cell = {-1, -1};
+    int hover_region = -1;
+    int hover_tolerance = 0;
+    bool hover_dirty = true;
+    // Records replayed from the journal at startup, and whether they started from a save
+    u64 recovered_records = 0;
+    bool recovered_from_save = false;
+    u64 frame_upload_bytes = 0;
+    u64 total_upload_bytes = 0;
+    void begin_stroke(Vector2 cell);
+    void stroke_to(Vector2 cell);
+    void end_stroke();
     bool is_point_inside(Vector2 point);
     void fill_region(Vector2 point);
+    // Replaces the color under point everywhere in the active layer
+    void replace_color(Vector2 point);
+    // Spans of the line or shape of the current mode dragged from first to last
+    void rasterize_drag(Vector2 first, Vector2 last, std::vector<Span>& spans);
+    void begin_line(Vector2 cell);
+    // Adds cell to the polygon being dragged, clamped to the canvas
+    void polygon_to(Vector2 cell);
+    void end_line();
     void draw(Vector2 mouse_position);
     void draw_preview(Vector2 mouse_position);
     void draw_preview_line(Vector2 mouse_position);
+    void draw_preview_fill(Vector2 cell);
+    void draw_canvas();
+    // Returns true when anything was uploaded
+    bool flush();
+    // Keeps the fill labels of the active layer current while the fill tool is in use.
+    // Returns true when new labels arrived.
+    bool update_labels();
+    bool save(const char* path);
+    // Opens the journal, replaying it first if there is one. Returns false if it can't be written.
+    bool open_journal(const char* path);
+    // The image saved at path as straight row-major pixels, if it is width x height
+    bool load_saved(const char* path, int width, int height, std::vector<u32>& pixels);
+    // Makes the image at path the custom brush stamp, returns false if it can't be loaded
+    bool load_brush(const char* path);
 };